@@ -0,0 +1,100 @@
+#!/bin/sh
+# Generates a synthetic directory tree for benchmarking.
+# usage: gen_tree.sh DIR SHAPE [SCALE]
+#   wide       one level, SCALE*100 directories of 10 files each
+#   deep       a chain of SCALE*20 nested directories, 5 files per level
+#   small      SCALE*10000 empty files across 100 directories
+#   hardlinks  SCALE*1000 files, each with 3 extra hard links
+#   symlinks   SCALE*1000 files plus a symlink to each
+#   mixed      all of the above under one root
+# Shape functions use distinct loop variables since sh has no locals.
+# Output is deterministic: file sizes follow from their index and every
+# mtime is set to 2020-01-01 so listings are comparable across runs.
+set -e
+
+dir=$1
+shape=$2
+scale=${3:-1}
+if [ -z "$dir" ] || [ -z "$shape" ]; then
+    echo "usage: $0 DIR wide|deep|small|hardlinks|symlinks|mixed [SCALE]" >&2
+    exit 1
+fi
+
+# files PREFIX COUNT: creates COUNT files of 0-4095 bytes in one process
+files() {
+    awk -v p="$1" -v n="$2" 'BEGIN {
+        for (k = 0; k < n; k++) {
+            f = p k
+            printf "%*s", (k * 7919) % 4096, "" > f
+            close(f)
+        }
+    }'
+}
+
+wide() {
+    n=$((scale * 100))
+    w=0
+    while [ $w -lt $n ]; do
+        mkdir -p "$1/d$w"
+        files "$1/d$w/f" 10
+        w=$((w + 1))
+    done
+}
+
+deep() {
+    n=$((scale * 20))
+    d=$1
+    l=0
+    while [ $l -lt $n ]; do
+        d=$d/l$l
+        mkdir -p "$d"
+        files "$d/f" 5
+        l=$((l + 1))
+    done
+}
+
+small() {
+    n=$((scale * 100))
+    s=0
+    while [ $s -lt 100 ]; do
+        mkdir -p "$1/s$s"
+        (cd "$1/s$s" && seq -f "e%g" 0 $((n - 1)) | xargs touch)
+        s=$((s + 1))
+    done
+}
+
+hardlinks() {
+    mkdir -p "$1"
+    files "$1/f" $((scale * 1000))
+    for f in "$1"/f*; do
+        ln "$f" "$f.a"
+        ln "$f" "$f.b"
+        ln "$f" "$f.c"
+    done
+}
+
+symlinks() {
+    mkdir -p "$1/targets" "$1/links"
+    files "$1/targets/f" $((scale * 1000))
+    for f in "$1"/targets/f*; do
+        ln -s "../targets/${f##*/}" "$1/links/${f##*/}"
+    done
+}
+
+rm -rf "$dir"
+mkdir -p "$dir"
+case $shape in
+wide | deep | small | hardlinks | symlinks)
+    $shape "$dir"
+    ;;
+mixed)
+    for part in wide deep small hardlinks symlinks; do
+        $part "$dir/$part"
+    done
+    ;;
+*)
+    echo "$0: unknown shape: $shape" >&2
+    exit 1
+    ;;
+esac
+find "$dir" -exec touch -h -d 2020-01-01 {} +
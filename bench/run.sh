@@ -0,0 +1,138 @@
+#!/bin/sh
+# Times lsp against `du -s` and `ls -l` on synthetic trees.
+# usage: run.sh [LSP_BINARY]
+# Environment:
+#   BENCH_DIR     where trees are generated (default /tmp/lsp-bench)
+#   BENCH_SHAPES  shapes to run (default "wide deep small hardlinks symlinks mixed")
+#   BENCH_SCALE   gen_tree.sh scale (default 10)
+#   BENCH_RUNS    timed samples per case (default 5)
+#   BENCH_BATCH   runs per warm sample (default: enough for about 200 ms)
+#   BENCH_OUT     output prefix, writes PREFIX.csv and PREFIX.json
+#                 (default $BENCH_DIR/results)
+# A warm sample times a batch of back-to-back runs between one pair of
+# timestamps, so starting the clock costs little next to short runs; the
+# time reported is per run, in ms to the microsecond, and the median of
+# the samples. Cold runs drop the page, dentry and inode caches before
+# every run, are timed one at a time and need root; without it they are
+# skipped. Syscall counts come from one extra `strace -fc` run per case,
+# summed by strace_calls.awk, and are left empty without strace.
+set -e
+
+here=$(dirname "$0")
+lsp=${1:-./lsp}
+root=${BENCH_DIR:-/tmp/lsp-bench}
+shapes=${BENCH_SHAPES:-wide deep small hardlinks symlinks mixed}
+scale=${BENCH_SCALE:-10}
+runs=${BENCH_RUNS:-5}
+out=${BENCH_OUT:-$root/results}
+
+if [ ! -x "$lsp" ]; then
+    echo "$0: $lsp is not executable, run make first" >&2
+    exit 1
+fi
+
+modes=warm
+if [ -w /proc/sys/vm/drop_caches ]; then
+    modes="warm cold"
+else
+    echo "$0: cannot drop caches, skipping cold runs" >&2
+fi
+have_strace=0
+command -v strace >/dev/null 2>&1 && have_strace=1
+
+now_ns() {
+    date +%s%N
+}
+
+# batch N CMD...: runs CMD N times back to back, prints the elapsed ns.
+# Called in a subshell, so its variables do not clash with the caller's.
+batch() {
+    n=$1
+    shift
+    t0=$(now_ns)
+    k=0
+    while [ $k -lt "$n" ]; do
+        "$@" > /dev/null 2>&1 || true
+        k=$((k + 1))
+    done
+    t1=$(now_ns)
+    echo $((t1 - t0))
+}
+
+# time_case CMD...: prints the wall time per run of each sample in us, one
+# per line, and sets per_sample; not to be run in a pipeline, which would
+# lose it
+time_case() {
+    per_sample=1
+    if [ "$mode" = warm ]; then
+        per_sample=${BENCH_BATCH:-0}
+        if [ "$per_sample" -le 0 ]; then
+            t=$(batch 1 "$@")
+            per_sample=$((200000000 / (t + 1) + 1))
+            [ $per_sample -le 1000 ] || per_sample=1000
+        fi
+    fi
+    r=0
+    while [ $r -lt "$runs" ]; do
+        if [ "$mode" = cold ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        t=$(batch $per_sample "$@")
+        echo $((t / per_sample / 1000))
+        r=$((r + 1))
+    done
+}
+
+# ms US: microseconds as milliseconds with three decimals
+ms() {
+    awk -v us="$1" 'BEGIN { printf "%.3f", us / 1000 }'
+}
+
+# syscalls CMD...: total syscall count across all threads, or empty
+syscalls() {
+    [ $have_strace = 1 ] || return 0
+    strace -f -c -o "$tmp.strace" "$@" > /dev/null 2>&1 || true
+    awk -f "$here/strace_calls.awk" "$tmp.strace"
+}
+
+tmp=$(mktemp)
+trap 'rm -f "$tmp" "$tmp.times" "$tmp.strace"' EXIT
+mkdir -p "$(dirname "$out")"
+echo "shape,tool,cache,runs,batch,min_ms,median_ms,max_ms,syscalls" > "$out.csv"
+echo "[" > "$out.json"
+first=1
+
+for shape in $shapes; do
+    tree=$root/$shape
+    if [ ! -f "$tree.done" ] || [ "$(cat "$tree.done")" != "$scale" ]; then
+        echo "generating $shape (scale $scale)" >&2
+        sh "$here/gen_tree.sh" "$tree" "$shape" "$scale"
+        echo "$scale" > "$tree.done"
+    fi
+    for tool in lsp du ls; do
+        case $tool in
+        lsp) set -- "$lsp" "$tree" ;;
+        du) set -- du -s "$tree" ;;
+        ls) set -- ls -l "$tree" ;;
+        esac
+        for mode in $modes; do
+            # one untimed run so warm numbers start from a warm cache
+            [ "$mode" = warm ] && { "$@" > /dev/null 2>&1 || true; }
+            time_case "$@" > "$tmp.times"
+            sort -n "$tmp.times" > "$tmp"
+            min=$(ms "$(head -n 1 "$tmp")")
+            max=$(ms "$(tail -n 1 "$tmp")")
+            med=$(ms "$(sed -n "$(((runs + 1) / 2))p" "$tmp")")
+            sc=$(syscalls "$@")
+            echo "$shape,$tool,$mode,$runs,$per_sample,$min,$med,$max,$sc" >> "$out.csv"
+            [ $first = 1 ] || echo "," >> "$out.json"
+            first=0
+            printf '  {"shape": "%s", "tool": "%s", "cache": "%s", "runs": %d, "batch": %d, "min_ms": %s, "median_ms": %s, "max_ms": %s, "syscalls": %s}' \
+                "$shape" "$tool" "$mode" "$runs" "$per_sample" "$min" "$med" "$max" "${sc:-null}" >> "$out.json"
+            printf '%-10s %-4s %-5s median %10s ms  syscalls %s\n' "$shape" "$tool" "$mode" "$med" "${sc:--}"
+        done
+    done
+done
+printf '\n]\n' >> "$out.json"
+echo "wrote $out.csv and $out.json" >&2
@@ -12,8 +12,23 @@
 #include <limits.h>
 #include <unistd.h>
 #include <glob.h>
+#include <fnmatch.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
 
 #define COLOR_RESET "\033[0m"
 #define COLOR_GREEN "\033[32m"
@@ -29,28 +44,210 @@
 
 #define BUF_SIZE 32
 #define THREAD_THRESHOLD 10
-#define THREAD_POOL_SIZE 4
 
+/* Names point into the listing's packed name buffer and dir is shared by
+   every entry of a listing, so an entry is a few dozen bytes. The full
+   path is rebuilt with entry_path only where it is needed. target_type
+   holds the S_IFMT bits of a symlink's target, shifted down by 12, or 0
+   when the target does not resolve. */
 typedef struct {
-    char *name;
-    char fullpath[PATH_MAX];
-    mode_t mode;
-    uid_t uid;
-    gid_t gid;
+    const char *name;
+    const char *dir;
+    char *link_target;
     off_t size;
     time_t mtime;
-    int is_dir;
-    int is_symlink;
-    char *link_target;
     ino_t inode;
     nlink_t nlink;
-    char size_str[BUF_SIZE];
-    char time_str[BUF_SIZE];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    unsigned char is_dir;
+    unsigned char is_symlink;
+    unsigned char size_pending;
+    unsigned char size_partial;
+    unsigned char target_type;
 } FileEntry;
 
 int opt_sort_by_size = 0;
 int opt_sort_by_name = 0;
 int opt_reverse_sort = 0;
+int opt_cache = 0;
+int opt_cache_verify = 0;
+int opt_uring = 0;
+int opt_count_links_once = 0;
+int opt_allocated = 0;
+long opt_deadline_ms = 0;
+int opt_one_fs = 0;
+int opt_device_jobs = 0;
+/* AT_STATX_DONT_SYNC with --dont-sync: network filesystems answer from
+   cached attributes instead of asking the server. */
+int opt_statx_sync = AT_STATX_SYNC_AS_STAT;
+
+/* Device of the directory the watch daemon covers; with -x it does not
+   leave it. Listings keep theirs in their WalkScope. */
+static dev_t walk_dev = 0;
+
+int opt_stats = 0;
+
+enum { FORMAT_TEXT, FORMAT_NDJSON, FORMAT_CSV, FORMAT_BINARY };
+int opt_format = FORMAT_TEXT;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum { PH_READDIR, PH_STAT, PH_SIZE, PH_WAIT, PH_SORT, PH_PRINT, PH_COUNT };
+static const char *phase_names[PH_COUNT] = {
+    "readdir", "stat entries", "size walk", "wait for sizes", "sort", "print"
+};
+
+enum { SC_GETDENTS, SC_OPEN, SC_STAT, SC_READLINK, SC_URING_ENTER, SC_URING_STATX, SC_OWNER, SC_COUNT };
+static const char *syscall_names[SC_COUNT] = {
+    "getdents64", "open", "stat", "readlink", "io_uring_enter", "statx via io_uring", "getpwuid/getgrgid"
+};
+
+/* --stats counters. Each thread owns one and updates it without atomics;
+   they are only summed once the workers have been joined. */
+typedef struct ThreadStats {
+    uint64_t phase_ns[PH_COUNT];
+    uint64_t calls[SC_COUNT];
+    uint64_t dirs;
+    uint64_t entries;
+    uint64_t tasks;
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+    uint64_t queue_wait_ns;
+    int worker;
+    struct ThreadStats *next;
+} ThreadStats;
+
+#define SLOWEST_SUBTREES 10
+
+typedef struct SubtreeTime {
+    char *path;
+    uint64_t ns;
+} SubtreeTime;
+
+static __thread ThreadStats *thread_stats = NULL;
+static ThreadStats *all_stats = NULL;
+static SubtreeTime slowest[SLOWEST_SUBTREES];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ThreadStats *stats_self(void) {
+    if (!thread_stats) {
+        thread_stats = calloc(1, sizeof(ThreadStats));
+        if (!thread_stats)
+            return NULL;
+        thread_stats->worker = -1;
+        pthread_mutex_lock(&stats_lock);
+        thread_stats->next = all_stats;
+        all_stats = thread_stats;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return thread_stats;
+}
+
+/* Start of a timed section; free when --stats is off. */
+static uint64_t stats_clock(void) {
+    return opt_stats ? monotonic_ns() : 0;
+}
+
+static void stats_phase(int phase, uint64_t start) {
+    ThreadStats *ts;
+    if (opt_stats && (ts = stats_self()))
+        ts->phase_ns[phase] += monotonic_ns() - start;
+}
+
+static void stats_calls(int call, uint64_t n) {
+    ThreadStats *ts;
+    if (opt_stats && (ts = stats_self()))
+        ts->calls[call] += n;
+}
+
+static void stats_visit(uint64_t dirs, uint64_t entries) {
+    ThreadStats *ts;
+    if (opt_stats && (ts = stats_self())) {
+        ts->dirs += dirs;
+        ts->entries += entries;
+    }
+}
+
+/* Keeps the SLOWEST_SUBTREES walks with the most worker time. */
+static void stats_subtree(const char *path, uint64_t ns) {
+    pthread_mutex_lock(&stats_lock);
+    int min = 0;
+    for (int i = 1; i < SLOWEST_SUBTREES; i++)
+        if (slowest[i].ns < slowest[min].ns)
+            min = i;
+    if (ns > slowest[min].ns) {
+        char *copy = strdup(path);
+        if (copy) {
+            free(slowest[min].path);
+            slowest[min].path = copy;
+            slowest[min].ns = ns;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static int subtree_time_cmp(const void *a, const void *b) {
+    uint64_t x = ((const SubtreeTime *)a)->ns, y = ((const SubtreeTime *)b)->ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Phase times are summed over threads, so stat entries and size walk can
+   exceed the run's wall time; wait for sizes is the part of the size walk
+   the listing actually blocked on. */
+static void stats_report(uint64_t wall_ns) {
+    ThreadStats sum = {0};
+    for (ThreadStats *ts = all_stats; ts; ts = ts->next) {
+        for (int i = 0; i < PH_COUNT; i++)
+            sum.phase_ns[i] += ts->phase_ns[i];
+        for (int i = 0; i < SC_COUNT; i++)
+            sum.calls[i] += ts->calls[i];
+        sum.dirs += ts->dirs;
+        sum.entries += ts->entries;
+    }
+    fprintf(stderr, "lsp stats: %.3f ms wall\n", wall_ns / 1e6);
+    fprintf(stderr, "phases (summed over threads):\n");
+    for (int i = 0; i < PH_COUNT; i++)
+        fprintf(stderr, "  %-20s %10.3f ms\n", phase_names[i], sum.phase_ns[i] / 1e6);
+    fprintf(stderr, "visited: %llu directories, %llu entries\n",
+            (unsigned long long)sum.dirs, (unsigned long long)sum.entries);
+    fprintf(stderr, "calls:\n");
+    for (int i = 0; i < SC_COUNT; i++)
+        if (sum.calls[i])
+            fprintf(stderr, "  %-20s %10llu\n", syscall_names[i], (unsigned long long)sum.calls[i]);
+    fprintf(stderr, "workers:      tasks     busy ms     idle ms  queue wait ms\n");
+    for (ThreadStats *ts = all_stats; ts; ts = ts->next) {
+        if (ts->worker < 0 && !ts->tasks)
+            continue;
+        if (ts->worker < 0)
+            fprintf(stderr, "  inline ");
+        else
+            fprintf(stderr, "  %6d ", ts->worker);
+        fprintf(stderr, "%10llu %11.3f %11.3f %14.3f\n", (unsigned long long)ts->tasks,
+                ts->busy_ns / 1e6, ts->idle_ns / 1e6, ts->queue_wait_ns / 1e6);
+    }
+    qsort(slowest, SLOWEST_SUBTREES, sizeof(SubtreeTime), subtree_time_cmp);
+    if (slowest[0].path)
+        fprintf(stderr, "slowest subtrees (worker time):\n");
+    for (int i = 0; i < SLOWEST_SUBTREES && slowest[i].path; i++)
+        fprintf(stderr, "  %10.3f ms  %s\n", slowest[i].ns / 1e6, slowest[i].path);
+}
+
+static void stats_free(void) {
+    while (all_stats) {
+        ThreadStats *next = all_stats->next;
+        free(all_stats);
+        all_stats = next;
+    }
+    thread_stats = NULL;
+    for (int i = 0; i < SLOWEST_SUBTREES; i++)
+        free(slowest[i].path);
+}
 
 void human_readable_size(off_t size, char *buf, size_t bufsize) {
     const char *units[] = {"B", "KB", "MB", "GB", "TB"};
@@ -138,560 +335,4841 @@ int cmp_entries(const void *a, const void *b) {
 
     if (opt_reverse_sort)
         result = -result;
+    if (result == 0)
+        result = strcmp(fa->name, fb->name);
     return result;
 }
 
-off_t get_directory_size(const char *path) {
-    off_t total = 0;
-    DIR *d = opendir(path);
-    if (!d)
-        return 0;
-    struct dirent *entry;
-    while ((entry = readdir(d)) != NULL) {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+typedef struct SortKey {
+    uint64_t key;
+    FileEntry *fe;
+} SortKey;
+
+/* Eight name bytes from offset, big-endian, so key order is strcmp order.
+   The caller guarantees the name is at least offset bytes long. */
+static uint64_t name_key(const char *name, size_t offset) {
+    uint64_t key = 0;
+    name += offset;
+    for (int i = 0; i < 8 && name[i]; i++)
+        key |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+    return key;
+}
+
+/* LSD radix sort on the 64-bit keys, one byte per pass; passes where every
+   key has the same byte are skipped. Stable, result ends up in keys. */
+static void radix_sort_keys(SortKey *keys, SortKey *tmp, size_t n) {
+    size_t counts[8][256] = {{0}};
+    for (size_t i = 0; i < n; i++)
+        for (int b = 0; b < 8; b++)
+            counts[b][(keys[i].key >> (8 * b)) & 0xff]++;
+    SortKey *src = keys, *dst = tmp;
+    for (int b = 0; b < 8; b++) {
+        if (counts[b][(keys[0].key >> (8 * b)) & 0xff] == n)
             continue;
-        char full[PATH_MAX];
-        snprintf(full, PATH_MAX, "%s/%s", path, entry->d_name);
-        if (entry->d_type != DT_UNKNOWN) {
-            if (entry->d_type == DT_DIR)
-                total += get_directory_size(full);
-            else {
-                struct stat st;
-                if (stat(full, &st) == 0)
-                    total += st.st_size;
-            }
-        } else {
-            struct stat st;
-            if (stat(full, &st) == 0) {
-                if (S_ISDIR(st.st_mode))
-                    total += get_directory_size(full);
-                else
-                    total += st.st_size;
-            }
+        size_t pos = 0;
+        for (int v = 0; v < 256; v++) {
+            size_t c = counts[b][v];
+            counts[b][v] = pos;
+            pos += c;
         }
+        for (size_t i = 0; i < n; i++)
+            dst[counts[b][(src[i].key >> (8 * b)) & 0xff]++] = src[i];
+        SortKey *swap = src;
+        src = dst;
+        dst = swap;
     }
-    closedir(d);
-    return total;
+    if (src != keys)
+        memcpy(keys, src, n * sizeof(SortKey));
 }
 
-typedef struct UidCache {
-    uid_t uid;
-    char username[256];
-    struct UidCache *next;
-} UidCache;
-static UidCache *uid_cache = NULL;
-
-const char* get_username_cached(uid_t uid) {
-    UidCache *cur = uid_cache;
-    while (cur) {
-        if (cur->uid == uid)
-            return cur->username;
-        cur = cur->next;
-    }
-    struct passwd pwd;
-    struct passwd *result = NULL;
-    char buf[1024];
-    if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &result) == 0 && result) {
-        UidCache *new_cache = malloc(sizeof(UidCache));
-        if (new_cache) {
-            new_cache->uid = uid;
-            strncpy(new_cache->username, pwd.pw_name, sizeof(new_cache->username) - 1);
-            new_cache->username[sizeof(new_cache->username) - 1] = '\0';
-            new_cache->next = uid_cache;
-            uid_cache = new_cache;
-            return new_cache->username;
-        }
-    }
-    return "unknown";
-}
-
-void free_uid_cache() {
-    UidCache *cur = uid_cache;
-    while (cur) {
-        UidCache *next = cur->next;
-        free(cur);
-        cur = next;
-    }
-    uid_cache = NULL;
-}
-
-typedef struct GidCache {
-    gid_t gid;
-    char groupname[256];
-    struct GidCache *next;
-} GidCache;
-static GidCache *gid_cache = NULL;
+/* Sorts by name from byte offset on, all names agreeing before it: radix
+   on the next eight bytes, then recurse into runs that still tie. A key
+   with a zero byte covers the end of the name, so such a run is equal. */
+static void sort_names(SortKey *keys, SortKey *tmp, size_t n, size_t offset, int desc) {
+    if (n < 16) {
+        for (size_t i = 1; i < n; i++) {
+            SortKey k = keys[i];
+            size_t j = i;
+            while (j > 0 && (desc ? -1 : 1) * strcmp(keys[j - 1].fe->name + offset, k.fe->name + offset) > 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = k;
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = name_key(keys[i].fe->name, offset);
+        keys[i].key = desc ? ~key : key;
+    }
+    radix_sort_keys(keys, tmp, n);
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && keys[j].key == keys[i].key)
+            j++;
+        if (j - i > 1 && memchr(keys[i].fe->name + offset, '\0', 8) == NULL)
+            sort_names(keys + i, tmp, j - i, offset + 8, desc);
+        i = j;
+    }
+}
 
-const char* get_groupname_cached(gid_t gid) {
-    GidCache *cur = gid_cache;
-    while (cur) {
-        if (cur->gid == gid)
-            return cur->groupname;
-        cur = cur->next;
+/* Same order as qsort with cmp_entries: directories are split out first,
+   each group is radix sorted on a key extracted next to its entry pointer,
+   and runs of equal size or mtime are then ordered by name. */
+void sort_entries(FileEntry **entries, size_t count) {
+    if (count < 2)
+        return;
+    SortKey *keys = malloc(count * sizeof(SortKey));
+    SortKey *tmp = malloc(count * sizeof(SortKey));
+    if (!keys || !tmp) {
+        free(keys);
+        free(tmp);
+        qsort(entries, count, sizeof(FileEntry *), cmp_entries);
+        return;
+    }
+    size_t ndirs = 0;
+    for (size_t i = 0; i < count; i++)
+        ndirs += entries[i]->is_dir;
+    size_t d = 0, f = ndirs;
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *fe = entries[i];
+        uint64_t key = opt_sort_by_size ? (uint64_t)fe->size : (uint64_t)fe->mtime ^ (1ULL << 63);
+        keys[fe->is_dir ? d++ : f++] = (SortKey){ opt_reverse_sort ? key : ~key, fe };
     }
-    struct group grp;
-    struct group *result = NULL;
-    char buf[1024];
-    if (getgrgid_r(gid, &grp, buf, sizeof(buf), &result) == 0 && result) {
-        GidCache *new_cache = malloc(sizeof(GidCache));
-        if (new_cache) {
-            new_cache->gid = gid;
-            strncpy(new_cache->groupname, grp.gr_name, sizeof(new_cache->groupname)-1);
-            new_cache->groupname[sizeof(new_cache->groupname)-1] = '\0';
-            new_cache->next = gid_cache;
-            gid_cache = new_cache;
-            return new_cache->groupname;
+    size_t bounds[3] = { 0, ndirs, count };
+    for (int g = 0; g < 2; g++) {
+        SortKey *group = keys + bounds[g];
+        size_t n = bounds[g + 1] - bounds[g];
+        if (opt_sort_by_name) {
+            sort_names(group, tmp, n, 0, opt_reverse_sort);
+            continue;
+        }
+        if (n == 0)
+            continue;
+        radix_sort_keys(group, tmp, n);
+        for (size_t i = 0; i < n;) {
+            size_t j = i + 1;
+            while (j < n && group[j].key == group[i].key)
+                j++;
+            if (j - i > 1)
+                sort_names(group + i, tmp, j - i, 0, 0);
+            i = j;
         }
     }
-    return "unknown";
+    for (size_t i = 0; i < count; i++)
+        entries[i] = keys[i].fe;
+    free(keys);
+    free(tmp);
 }
 
-void free_gid_cache() {
-    GidCache *cur = gid_cache;
-    while (cur) {
-        GidCache *next = cur->next;
-        free(cur);
-        cur = next;
-    }
-    gid_cache = NULL;
+#define DIR_READ_BUF (256 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Reads a directory with getdents64 into one large buffer. Each thread keeps
+   a buffer for reuse; a nested reader on the same thread gets its own. */
+typedef struct {
+    int fd;
+    char *buf;
+    long len;
+    long pos;
+    int error;
+} DirReader;
+
+static __thread char *dir_read_buf = NULL;
+static __thread int dir_read_buf_busy = 0;
+
+static void dir_read_buf_free(void *buf) {
+    free(buf);
 }
 
-typedef struct Task {
-    void (*function)(void *);
-    void *arg;
-    struct Task *next;
-} Task;
+static pthread_key_t dir_read_key;
+static pthread_once_t dir_read_key_once = PTHREAD_ONCE_INIT;
 
-typedef struct ThreadPool {
-    pthread_t *threads;
-    int num_threads;
-    Task *task_queue_head;
-    Task *task_queue_tail;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    int stop;
-    int tasks_pending;
-    pthread_cond_t tasks_done;
-} ThreadPool;
+static void dir_read_key_init(void) {
+    pthread_key_create(&dir_read_key, dir_read_buf_free);
+}
 
-static void *thread_pool_worker(void *arg) {
-    ThreadPool *pool = (ThreadPool *)arg;
-    while (1) {
-        pthread_mutex_lock(&pool->lock);
-        while (!pool->task_queue_head && !pool->stop)
-            pthread_cond_wait(&pool->cond, &pool->lock);
-        if (pool->stop && !pool->task_queue_head) {
-            pthread_mutex_unlock(&pool->lock);
-            break;
+int dir_reader_init(DirReader *r, int fd) {
+    r->fd = fd;
+    r->len = r->pos = 0;
+    r->error = 0;
+    if (!dir_read_buf_busy) {
+        if (!dir_read_buf) {
+            pthread_once(&dir_read_key_once, dir_read_key_init);
+            dir_read_buf = malloc(DIR_READ_BUF);
+            if (!dir_read_buf)
+                return -1;
+            pthread_setspecific(dir_read_key, dir_read_buf);
         }
-        Task *task = pool->task_queue_head;
-        pool->task_queue_head = task->next;
-        if (!pool->task_queue_head)
-            pool->task_queue_tail = NULL;
-        pthread_mutex_unlock(&pool->lock);
-        
-        task->function(task->arg);
-        free(task);
-        
-        pthread_mutex_lock(&pool->lock);
-        pool->tasks_pending--;
-        if (pool->tasks_pending == 0 && pool->task_queue_head == NULL)
-            pthread_cond_signal(&pool->tasks_done);
-        pthread_mutex_unlock(&pool->lock);
+        dir_read_buf_busy = 1;
+        r->buf = dir_read_buf;
+        return 0;
     }
-    return NULL;
+    r->buf = malloc(DIR_READ_BUF);
+    return r->buf ? 0 : -1;
 }
 
-ThreadPool *thread_pool_create(int num_threads) {
-    ThreadPool *pool = malloc(sizeof(ThreadPool));
-    if (!pool)
-        return NULL;
-    pool->num_threads = num_threads;
-    pool->stop = 0;
-    pool->tasks_pending = 0;
-    pool->task_queue_head = pool->task_queue_tail = NULL;
-    pthread_mutex_init(&pool->lock, NULL);
-    pthread_cond_init(&pool->cond, NULL);
-    pthread_cond_init(&pool->tasks_done, NULL);
-    pool->threads = malloc(num_threads * sizeof(pthread_t));
-    if (!pool->threads) {
-        free(pool);
-        return NULL;
-    }
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
-            free(pool->threads);
-            free(pool);
+struct linux_dirent64 *dir_reader_next(DirReader *r) {
+    if (r->pos >= r->len) {
+        long n = syscall(SYS_getdents64, r->fd, r->buf, DIR_READ_BUF);
+        stats_calls(SC_GETDENTS, 1);
+        if (n <= 0) {
+            if (n < 0)
+                r->error = errno;
             return NULL;
         }
+        r->len = n;
+        r->pos = 0;
     }
-    return pool;
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(r->buf + r->pos);
+    r->pos += d->d_reclen;
+    return d;
 }
 
-void thread_pool_add_task(ThreadPool *pool, void (*function)(void *), void *arg) {
-    Task *task = malloc(sizeof(Task));
-    if (!task)
-        return;
-    task->function = function;
-    task->arg = arg;
-    task->next = NULL;
-    pthread_mutex_lock(&pool->lock);
-    if (pool->task_queue_tail)
-        pool->task_queue_tail->next = task;
+void dir_reader_release(DirReader *r) {
+    if (r->buf == dir_read_buf)
+        dir_read_buf_busy = 0;
     else
-        pool->task_queue_head = task;
-    pool->task_queue_tail = task;
-    pool->tasks_pending++;
-    pthread_cond_signal(&pool->cond);
-    pthread_mutex_unlock(&pool->lock);
+        free(r->buf);
+    r->buf = NULL;
 }
 
-void thread_pool_wait(ThreadPool *pool) {
-    pthread_mutex_lock(&pool->lock);
-    while (pool->tasks_pending || pool->task_queue_head)
-        pthread_cond_wait(&pool->tasks_done, &pool->lock);
-    pthread_mutex_unlock(&pool->lock);
+static int is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
 }
 
-void thread_pool_destroy(ThreadPool *pool) {
-    pthread_mutex_lock(&pool->lock);
-    pool->stop = 1;
-    pthread_cond_broadcast(&pool->cond);
-    pthread_mutex_unlock(&pool->lock);
-    for (int i = 0; i < pool->num_threads; i++)
-        pthread_join(pool->threads[i], NULL);
-    free(pool->threads);
-    pthread_mutex_destroy(&pool->lock);
-    pthread_cond_destroy(&pool->cond);
-    pthread_cond_destroy(&pool->tasks_done);
-    free(pool);
+/* --exclude and --include patterns, matched against entry names. Each is
+   classified once: plain names, "prefix*" and "*suffix" are compared
+   directly, anything else goes through fnmatch. */
+enum { PAT_LITERAL, PAT_PREFIX, PAT_SUFFIX, PAT_GLOB };
+
+typedef struct {
+    int kind;
+    const char *text;
+    size_t len;
+} NamePattern;
+
+typedef struct {
+    NamePattern *items;
+    size_t count;
+} PatternList;
+
+static PatternList excludes, includes;
+
+static int pattern_add(PatternList *pl, const char *pattern) {
+    NamePattern *items = realloc(pl->items, (pl->count + 1) * sizeof(NamePattern));
+    if (!items)
+        return -1;
+    pl->items = items;
+    size_t len = strlen(pattern);
+    const char *meta = "*?[\\";
+    NamePattern p = { PAT_GLOB, pattern, len };
+    if (!pattern[strcspn(pattern, meta)])
+        p.kind = PAT_LITERAL;
+    else if (len > 1 && pattern[len - 1] == '*' && strcspn(pattern, meta) == len - 1)
+        p = (NamePattern){ PAT_PREFIX, pattern, len - 1 };
+    else if (len > 1 && pattern[0] == '*' && !pattern[1 + strcspn(pattern + 1, meta)])
+        p = (NamePattern){ PAT_SUFFIX, pattern + 1, len - 1 };
+    pl->items[pl->count++] = p;
+    return 0;
 }
 
-FileEntry *populate_file_entry(const char *name, const char *fullpath, const struct stat *st, time_t now) {
-    FileEntry *fe = malloc(sizeof(FileEntry));
-    if (!fe)
-        return NULL;
-    fe->name = strdup(name);
-    strncpy(fe->fullpath, fullpath, PATH_MAX - 1);
-    fe->fullpath[PATH_MAX - 1] = '\0';
-    fe->mode = st->st_mode;
-    fe->uid = st->st_uid;
-    fe->gid = st->st_gid;
-    fe->mtime = st->st_mtime;
-    fe->inode = st->st_ino;
-    fe->nlink = st->st_nlink;
-    fe->is_dir = S_ISDIR(st->st_mode);
-    if (S_ISLNK(st->st_mode)) {
-        fe->is_symlink = 1;
-        char target[PATH_MAX];
-        ssize_t len = readlink(fullpath, target, sizeof(target) - 1);
-        if (len != -1) {
-            target[len] = '\0';
-            fe->link_target = strdup(target);
-        } else
-            fe->link_target = strdup("unreadable");
-        fe->size = st->st_size;
-    } else {
-        fe->is_symlink = 0;
-        fe->link_target = NULL;
-        fe->size = fe->is_dir ? get_directory_size(fullpath) : st->st_size;
+static int pattern_match(const PatternList *pl, const char *name) {
+    size_t name_len = 0;
+    for (size_t i = 0; i < pl->count; i++) {
+        const NamePattern *p = &pl->items[i];
+        switch (p->kind) {
+        case PAT_LITERAL:
+            if (!strcmp(name, p->text))
+                return 1;
+            break;
+        case PAT_PREFIX:
+            if (!strncmp(name, p->text, p->len))
+                return 1;
+            break;
+        case PAT_SUFFIX:
+            if (!name_len)
+                name_len = strlen(name);
+            if (name_len >= p->len && !memcmp(name + name_len - p->len, p->text, p->len))
+                return 1;
+            break;
+        default:
+            if (!fnmatch(p->text, name, 0))
+                return 1;
+        }
     }
-    human_readable_size(fe->size, fe->size_str, sizeof(fe->size_str));
-    time_ago(fe->mtime, now, fe->time_str, sizeof(fe->time_str));
-    return fe;
+    return 0;
 }
 
-FileEntry* create_file_entry_with_now(const char *filepath, time_t now) {
-    struct stat st;
-    if (fstatat(AT_FDCWD, filepath, &st, AT_SYMLINK_NOFOLLOW) < 0)
-        return NULL;
-    return populate_file_entry(filepath, filepath, &st, now);
+/* Checked on d_name before anything is stat'ed or opened, so an excluded
+   directory is never descended into. An include wins over an exclude. */
+static inline int name_excluded(const char *name) {
+    return excludes.count && pattern_match(&excludes, name) && !pattern_match(&includes, name);
 }
 
-void process_file_collect(const char *filepath, FileEntry ***files, size_t *count, size_t *cap) {
-    time_t now = time(NULL);
-    FileEntry *fe = create_file_entry_with_now(filepath, now);
-    if (!fe)
-        return;
-    if (*count >= *cap) {
-        *cap *= 2;
-        FileEntry **tmp = realloc(*files, *cap * sizeof(FileEntry *));
-        if (!tmp) {
-            free(fe->name);
-            free(fe);
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    uint32_t count;
+} NameList;
+
+static void name_list_add(NameList *nl, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (nl->len + len > nl->cap) {
+        size_t cap = nl->cap ? nl->cap * 2 : 256;
+        while (cap < nl->len + len)
+            cap *= 2;
+        char *tmp = realloc(nl->data, cap);
+        if (!tmp)
             return;
-        }
-        *files = tmp;
+        nl->data = tmp;
+        nl->cap = cap;
     }
-    (*files)[(*count)++] = fe;
+    memcpy(nl->data + nl->len, name, len);
+    nl->len += len;
+    nl->count++;
 }
 
+#define INODE_SHARDS 64
+
 typedef struct {
-    int dirfd;
-    char dirpath[PATH_MAX];
-    char dname[NAME_MAX + 1];
-    FileEntry **result;
-    time_t now;
-} ThreadTaskArg;
+    uint64_t dev;
+    uint64_t ino;
+} InodeKey;
 
-void process_entry_task(void *arg) {
-    ThreadTaskArg *tta = (ThreadTaskArg *)arg;
-    char full[PATH_MAX];
-    snprintf(full, PATH_MAX, "%s/%s", tta->dirpath, tta->dname);
-    struct stat st;
-    if (fstatat(tta->dirfd, tta->dname, &st, AT_SYMLINK_NOFOLLOW) < 0)
-        *(tta->result) = NULL;
-    else {
-        FileEntry *fe = malloc(sizeof(FileEntry));
-        if (fe) {
-            fe->name = strdup(tta->dname);
-            strncpy(fe->fullpath, full, PATH_MAX - 1);
-            fe->fullpath[PATH_MAX - 1] = '\0';
-            fe->mode = st.st_mode;
-            fe->uid = st.st_uid;
-            fe->gid = st.st_gid;
-            fe->mtime = st.st_mtime;
-            fe->inode = st.st_ino;
-            fe->nlink = st.st_nlink;
-            fe->is_dir = S_ISDIR(st.st_mode);
-            if (S_ISLNK(st.st_mode)) {
-                fe->is_symlink = 1;
-                char target[PATH_MAX];
-                ssize_t len = readlink(full, target, sizeof(target) - 1);
-                if (len != -1) {
-                    target[len] = '\0';
-                    fe->link_target = strdup(target);
-                } else
-                    fe->link_target = strdup("unreadable");
-                fe->size = st.st_size;
-            } else {
-                fe->is_symlink = 0;
-                fe->link_target = NULL;
-                fe->size = fe->is_dir ? get_directory_size(full) : st.st_size;
-            }
-            human_readable_size(fe->size, fe->size_str, sizeof(fe->size_str));
-            time_ago(fe->mtime, tta->now, fe->time_str, sizeof(fe->time_str));
-            *(tta->result) = fe;
-        } else
-            *(tta->result) = NULL;
+/* Set of (st_dev, st_ino) seen so far, split into independently locked
+   shards so pool workers rarely contend on the same lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    InodeKey *slots;
+    size_t cap;
+    size_t count;
+} __attribute__((aligned(64))) InodeShard;
+
+static InodeShard inode_set[INODE_SHARDS];
+static pthread_once_t inode_set_once = PTHREAD_ONCE_INIT;
+
+static void inode_set_init(void) {
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        pthread_mutex_init(&inode_set[i].lock, NULL);
+        inode_set[i].slots = NULL;
+        inode_set[i].cap = inode_set[i].count = 0;
     }
-    free(tta);
 }
 
-void print_entries(FileEntry **entries, size_t count, int show_inode) {
-    int max_perm = 0, max_user = 0, max_size = 0, max_date = 0, max_inode = 0, max_nlink = 0;
-    size_t max_name = 0;
-    char line[1024];
-    for (size_t i = 0; i < count; i++) {
-        FileEntry *fe = entries[i];
-        char perms[11];
-        get_permission_string(fe->mode, perms);
-        int len = strlen(perms);
-        if (len > max_perm)
-            max_perm = len;
-        char usergroup[64];
-        const char *username = get_username_cached(fe->uid);
-        const char *groupname = get_groupname_cached(fe->gid);
-        snprintf(usergroup, sizeof(usergroup), "%s:%s", username, groupname);
-        len = strlen(usergroup);
-        if (len > max_user)
-            max_user = len;
-        len = strlen(fe->size_str);
-        if (len > max_size)
-            max_size = len;
-        len = strlen(fe->time_str);
-        if (len > max_date)
-            max_date = len;
-        len = strlen(fe->name);
-        if (len > max_name)
-            max_name = len;
-        if (show_inode) {
-            char inode_str[BUF_SIZE];
-            snprintf(inode_str, sizeof(inode_str), "%lu", (unsigned long)fe->inode);
-            len = strlen(inode_str);
-            if (len > max_inode)
-                max_inode = len;
-            snprintf(inode_str, sizeof(inode_str), "%lu", (unsigned long)fe->nlink);
-            len = strlen(inode_str);
-            if (len > max_nlink)
-                max_nlink = len;
-        }
-    }
-    for (size_t i = 0; i < count; i++) {
-        FileEntry *fe = entries[i];
-        char perms[11];
-        get_permission_string(fe->mode, perms);
-        const char *username = get_username_cached(fe->uid);
-        const char *groupname = get_groupname_cached(fe->gid);
-        char usergroup[64];
-        snprintf(usergroup, sizeof(usergroup), "%s:%s", username, groupname);
-        const char *size_color = "";
-        if (strstr(fe->size_str, "KB"))
-            size_color = COLOR_GREEN;
-        else if (strstr(fe->size_str, "MB"))
-            size_color = COLOR_ORANGE;
-        else if (strstr(fe->size_str, "GB"))
-            size_color = COLOR_RED;
-        const char *date_color = "";
-        time_t now = time(NULL);
-        double seconds = difftime(now, fe->mtime);
-        if (seconds >= 31536000)
-            date_color = COLOR_DARK_GREY;
-        else if (seconds >= 2592000)
-            date_color = COLOR_GREY;
-        const char *name_color;
-        if (fe->is_symlink)
-            name_color = COLOR_SYMLINK;
-        else if (fe->is_dir)
-            name_color = COLOR_DIR;
-        else if ((fe->mode & S_IXUSR) || (fe->mode & S_IXGRP) || (fe->mode & S_IXOTH))
-            name_color = COLOR_GREEN;
-        else
-            name_color = COLOR_FILE;
-        int pos = 0;
-        if (show_inode) {
-            char inode_str[BUF_SIZE];
-            snprintf(inode_str, sizeof(inode_str), "%-*lu", max_inode, (unsigned long)fe->inode);
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s  ", inode_str);
-            snprintf(inode_str, sizeof(inode_str), "%-*lu", max_nlink, (unsigned long)fe->nlink);
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s  ", inode_str);
-        }
-        pos += snprintf(line + pos, sizeof(line) - pos, "%-*s  %-*s  %s%-*s%s  %s%-*s%s  ",
-                        max_perm, perms,
-                        max_user, usergroup,
-                        size_color, max_size, fe->size_str, COLOR_RESET,
-                        date_color, max_date, fe->time_str, COLOR_RESET);
-        if (fe->is_symlink && fe->link_target) {
-            struct stat st_target;
-            int stat_ret = stat(fe->fullpath, &st_target);
-            const char *target_color = COLOR_LINKTARGET;
-            int is_char = 0, is_block = 0;
-            if (stat_ret == 0) {
-                if (S_ISDIR(st_target.st_mode))
-                    target_color = COLOR_DIR;
-                else if (S_ISCHR(st_target.st_mode))
-                    is_char = 1;
-                else if (S_ISBLK(st_target.st_mode))
-                    is_block = 1;
-            }
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s%s%s -> %s%s%s", name_color, fe->name, COLOR_RESET, target_color, fe->link_target, COLOR_RESET);
-            if (is_char)
-                pos += snprintf(line + pos, sizeof(line) - pos, "%s*%s", COLOR_RED, COLOR_RESET);
-            else if (is_block)
-                pos += snprintf(line + pos, sizeof(line) - pos, "%s#%s", COLOR_YELLOW, COLOR_RESET);
-        } else {
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s%s%s", name_color, fe->name, COLOR_RESET);
-        }
-        if (S_ISCHR(fe->mode))
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s*%s", COLOR_RED, COLOR_RESET);
-        else if (S_ISBLK(fe->mode))
-            pos += snprintf(line + pos, sizeof(line) - pos, "%s#%s", COLOR_YELLOW, COLOR_RESET);
-        puts(line);
-    }
+static uint64_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-void process_directory(const char *dirpath, int show_hidden, int print_header, int show_inode) {
-    struct dirent **namelist;
-    int n = scandir(dirpath, &namelist, NULL, alphasort);
-    if (n < 0)
-        return;
-    if (print_header)
-        printf("%s:\n", dirpath);
-    int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
-    if (dirfd < 0) {
-        for (int i = 0; i < n; i++) {
-            free(namelist[i]);
-        }
-        free(namelist);
-        return;
-    }
-    FileEntry **entries = malloc(n * sizeof(FileEntry *));
-    size_t count = 0;
-    time_t now = time(NULL);
-    int use_thread_pool = (n >= THREAD_THRESHOLD);
-    ThreadPool *pool = NULL;
-    if (use_thread_pool)
-        pool = thread_pool_create(THREAD_POOL_SIZE);
-    for (int i = 0; i < n; i++) {
-        if (!namelist[i])
+static int inode_shard_grow(InodeShard *s) {
+    size_t cap = s->cap ? s->cap * 2 : 1024;
+    InodeKey *slots = calloc(cap, sizeof(InodeKey));
+    if (!slots)
+        return -1;
+    for (size_t i = 0; i < s->cap; i++) {
+        InodeKey k = s->slots[i];
+        if (!k.dev && !k.ino)
             continue;
-        if (!show_hidden && namelist[i]->d_name[0] == '.') {
-            free(namelist[i]);
-            continue;
-        }
-        if (use_thread_pool) {
-            ThreadTaskArg *tta = malloc(sizeof(ThreadTaskArg));
-            if (!tta) {
-                char full[PATH_MAX];
-                snprintf(full, PATH_MAX, "%s/%s", dirpath, namelist[i]->d_name);
-                struct stat st;
-                if (fstatat(dirfd, namelist[i]->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
-                    FileEntry *fe = populate_file_entry(namelist[i]->d_name, full, &st, now);
-                    entries[count++] = fe;
-                }
-                free(namelist[i]);
-                continue;
-            }
-            tta->dirfd = dirfd;
-            strncpy(tta->dirpath, dirpath, PATH_MAX - 1);
-            tta->dirpath[PATH_MAX - 1] = '\0';
-            strncpy(tta->dname, namelist[i]->d_name, NAME_MAX);
-            tta->dname[NAME_MAX] = '\0';
-            tta->result = &entries[count];
-            tta->now = now;
-            thread_pool_add_task(pool, process_entry_task, tta);
-            count++;
-        } else {
-            char full[PATH_MAX];
-            snprintf(full, PATH_MAX, "%s/%s", dirpath, namelist[i]->d_name);
-            struct stat st;
-            if (fstatat(dirfd, namelist[i]->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-                free(namelist[i]);
-                continue;
-            }
-            FileEntry *fe = populate_file_entry(namelist[i]->d_name, full, &st, now);
-            entries[count++] = fe;
-        }
-        free(namelist[i]);
+        size_t j = (inode_hash(k.dev, k.ino) >> 6) & (cap - 1);
+        while (slots[j].dev || slots[j].ino)
+            j = (j + 1) & (cap - 1);
+        slots[j] = k;
     }
+    free(s->slots);
+    s->slots = slots;
+    s->cap = cap;
+    return 0;
+}
 
-    free(namelist);
-    if (use_thread_pool) {
-        thread_pool_wait(pool);
-        thread_pool_destroy(pool);
+/* Returns 1 the first time an inode is seen, 0 afterwards. If the set cannot
+   grow the inode is reported as new, which errs towards counting it. */
+int inode_set_insert(uint64_t dev, uint64_t ino) {
+    pthread_once(&inode_set_once, inode_set_init);
+    uint64_t h = inode_hash(dev, ino);
+    InodeShard *s = &inode_set[h & (INODE_SHARDS - 1)];
+    int inserted = 1;
+    pthread_mutex_lock(&s->lock);
+    if ((s->count + 1) * 4 > s->cap * 3 && inode_shard_grow(s) < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return 1;
     }
-    close(dirfd);
-    qsort(entries, count, sizeof(FileEntry *), cmp_entries);
-    print_entries(entries, count, show_inode);
-    if (print_header)
-        printf("\n");
-    for (size_t i = 0; i < count; i++) {
-        if (entries[i]) {
-            free(entries[i]->name);
-            if (entries[i]->link_target)
-                free(entries[i]->link_target);
-            free(entries[i]);
+    size_t j = (h >> 6) & (s->cap - 1);
+    while (s->slots[j].dev || s->slots[j].ino) {
+        if (s->slots[j].dev == dev && s->slots[j].ino == ino) {
+            inserted = 0;
+            break;
         }
+        j = (j + 1) & (s->cap - 1);
     }
-    free(entries);
+    if (inserted) {
+        s->slots[j].dev = dev;
+        s->slots[j].ino = ino;
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return inserted;
 }
 
-void process_path(const char *path, int show_hidden, int print_header,
-                  FileEntry ***file_files, size_t *file_count, size_t *file_cap, int show_inode) {
-    struct stat st;
-    if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0)
-        return;
-    if (S_ISDIR(st.st_mode))
-        process_directory(path, show_hidden, print_header, show_inode);
-    else
-        process_file_collect(path, file_files, file_count, file_cap);
+void inode_set_free(void) {
+    pthread_once(&inode_set_once, inode_set_init);
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        free(inode_set[i].slots);
+        inode_set[i].slots = NULL;
+        inode_set[i].cap = inode_set[i].count = 0;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    int show_hidden = 0, show_inode = 0, nonflag_count = 0;
-    for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-' && strlen(argv[i]) > 1) {
-            size_t len = strlen(argv[i]);
+/* Size a file contributes to a directory total: allocated or apparent, and
+   zero for a hardlink whose inode was already counted. */
+off_t accounted_size(uint64_t dev, uint64_t ino, nlink_t nlink, off_t size, blkcnt_t blocks) {
+    if (opt_count_links_once && nlink > 1 && !inode_set_insert(dev, ino))
+        return 0;
+    return opt_allocated ? (off_t)blocks * 512 : size;
+}
+
+off_t stat_accounted_size(const struct stat *st) {
+    return accounted_size(st->st_dev, st->st_ino, st->st_nlink, st->st_size, st->st_blocks);
+}
+
+off_t statx_accounted_size(const struct statx *stx) {
+    return accounted_size(makedev(stx->stx_dev_major, stx->stx_dev_minor), stx->stx_ino, stx->stx_nlink,
+                          stx->stx_size, stx->stx_blocks);
+}
+
+/* Fields a size walk reads: the type, and what accounted_size needs. */
+static unsigned size_stat_mask(void) {
+    return STATX_TYPE | (opt_allocated ? STATX_BLOCKS : STATX_SIZE) |
+           (opt_count_links_once ? STATX_INO | STATX_NLINK : 0);
+}
+
+/* Fields a listed entry shows. Times other than mtime are never printed. */
+static unsigned entry_stat_mask(void) {
+    return (STATX_BASIC_STATS & ~(STATX_ATIME | STATX_CTIME | STATX_BLOCKS)) | (opt_allocated ? STATX_BLOCKS : 0);
+}
+
+/* fstatat through statx, so only the fields in mask have to be fetched.
+   The others are left zero in st. */
+static int stat_at(int dirfd, const char *name, int flags, unsigned mask, struct stat *st) {
+    struct statx stx;
+    if (statx(dirfd, name, flags | opt_statx_sync, mask, &stx) != 0)
+        return -1;
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim = (struct timespec){ stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec };
+    st->st_mtim = (struct timespec){ stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec };
+    st->st_ctim = (struct timespec){ stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec };
+    return 0;
+}
+
+/* uid or gid to name, shared by every thread. Names are interned once and
+   never move, so a returned pointer stays valid until id_names_free. Ids
+   NSS does not know are cached too, with a NULL name; a failed lookup is
+   not, and shows the number until a later lookup succeeds. */
+typedef struct {
+    uint32_t id;
+    unsigned char used;
+    const char *name;
+} IdName;
+
+typedef struct {
+    pthread_mutex_t lock;
+    IdName *slots;
+    size_t cap;
+    size_t count;
+    int group;
+} IdNameCache;
+
+static IdNameCache user_names = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+static IdNameCache group_names = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 1 };
+static pthread_once_t id_names_once = PTHREAD_ONCE_INIT;
+
+static size_t id_name_slot(const IdName *slots, size_t cap, uint32_t id) {
+    size_t j = ((uint64_t)id * 0x9e3779b97f4a7c15ULL >> 32) & (cap - 1);
+    while (slots[j].used && slots[j].id != id)
+        j = (j + 1) & (cap - 1);
+    return j;
+}
+
+/* Adds id unless it is already known; the caller holds the lock. */
+static void id_name_insert(IdNameCache *c, uint32_t id, const char *name) {
+    if ((c->count + 1) * 2 > c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 256;
+        IdName *slots = calloc(cap, sizeof(IdName));
+        if (!slots)
+            return;
+        for (size_t i = 0; i < c->cap; i++) {
+            if (c->slots[i].used)
+                slots[id_name_slot(slots, cap, c->slots[i].id)] = c->slots[i];
+        }
+        free(c->slots);
+        c->slots = slots;
+        c->cap = cap;
+    }
+    IdName *s = &c->slots[id_name_slot(c->slots, c->cap, id)];
+    if (s->used)
+        return;
+    s->used = 1;
+    s->id = id;
+    s->name = name ? strdup(name) : NULL;
+    c->count++;
+}
+
+/* Bulk loads name:passwd:id lines, so hosts whose owners all live in the
+   local files never go through NSS one id at a time. The first line for
+   an id wins, as it does in the files backend; NIS compat lines are left
+   to NSS. */
+static void id_names_preload_file(IdNameCache *c, const char *path) {
+    FILE *f = fopen(path, "re");
+    if (!f)
+        return;
+    char line[1024];
+    pthread_mutex_lock(&c->lock);
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '+' || line[0] == '-' || line[0] == '#')
+            continue;
+        char *name_end = strchr(line, ':');
+        char *id_str = name_end ? strchr(name_end + 1, ':') : NULL;
+        if (!id_str || name_end == line)
+            continue;
+        char *end;
+        unsigned long id = strtoul(id_str + 1, &end, 10);
+        if (*end != ':' || end == id_str + 1 || id > UINT32_MAX)
+            continue;
+        *name_end = '\0';
+        id_name_insert(c, (uint32_t)id, line);
+    }
+    pthread_mutex_unlock(&c->lock);
+    fclose(f);
+}
+
+/* Whether nsswitch.conf asks the files backend first for db, as glibc
+   also does when the file or the line is missing. Only then does the
+   preload give the answers NSS would. */
+static int nss_files_first(const char *db) {
+    FILE *f = fopen("/etc/nsswitch.conf", "re");
+    if (!f)
+        return 1;
+    char line[1024];
+    size_t n = strlen(db);
+    int files_first = 1;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        if (strncmp(p, db, n) != 0)
+            continue;
+        p += n + strspn(p + n, " \t");
+        if (*p != ':')
+            continue;
+        p += 1 + strspn(p + 1, " \t");
+        files_first = strncmp(p, "files", 5) == 0 && (!p[5] || strchr(" \t\n[", p[5]));
+        break;
+    }
+    fclose(f);
+    return files_first;
+}
+
+static void id_names_preload(void) {
+    if (nss_files_first("passwd"))
+        id_names_preload_file(&user_names, "/etc/passwd");
+    if (nss_files_first("group"))
+        id_names_preload_file(&group_names, "/etc/group");
+}
+
+static const char *id_name_lookup(IdNameCache *c, uint32_t id) {
+    pthread_once(&id_names_once, id_names_preload);
+    pthread_mutex_lock(&c->lock);
+    if (c->cap) {
+        const IdName *s = &c->slots[id_name_slot(c->slots, c->cap, id)];
+        if (s->used) {
+            const char *name = s->name;
+            pthread_mutex_unlock(&c->lock);
+            return name ? name : "unknown";
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* Resolved without the lock held: a slow NSS backend must not stall
+       other threads, and a racing lookup of the same id is harmless. */
+    char stack_buf[1024];
+    char *buf = stack_buf;
+    size_t len = sizeof(stack_buf);
+    const char *name = NULL;
+    int err;
+    stats_calls(SC_OWNER, 1);
+    for (;;) {
+        if (c->group) {
+            struct group grp, *result = NULL;
+            err = getgrgid_r(id, &grp, buf, len, &result);
+            if (!err && result)
+                name = grp.gr_name;
+        } else {
+            struct passwd pwd, *result = NULL;
+            err = getpwuid_r(id, &pwd, buf, len, &result);
+            if (!err && result)
+                name = pwd.pw_name;
+        }
+        if (err != ERANGE || len >= 1 << 20)
+            break;
+        char *bigger = realloc(buf == stack_buf ? NULL : buf, len * 4);
+        if (!bigger)
+            break;
+        buf = bigger;
+        len *= 4;
+    }
+    if (err) {
+        /* EIO, EAGAIN or a backend timeout says nothing about the id */
+        static __thread char numeric[2][12];
+        snprintf(numeric[c->group], sizeof(numeric[0]), "%u", id);
+        if (buf != stack_buf)
+            free(buf);
+        return numeric[c->group];
+    }
+    pthread_mutex_lock(&c->lock);
+    id_name_insert(c, id, name);
+    const char *interned = NULL;
+    if (c->cap) {
+        const IdName *s = &c->slots[id_name_slot(c->slots, c->cap, id)];
+        if (s->used)
+            interned = s->name;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (buf != stack_buf)
+        free(buf);
+    return interned ? interned : "unknown";
+}
+
+const char *get_username_cached(uid_t uid) {
+    return id_name_lookup(&user_names, uid);
+}
+
+const char *get_groupname_cached(gid_t gid) {
+    return id_name_lookup(&group_names, gid);
+}
+
+/* Called per entry from the pool workers, so NSS misses overlap with the
+   stat phase instead of landing in the serial print_entries. Consecutive
+   entries usually share an owner, which skips the locks. */
+static void id_names_warm(uid_t uid, gid_t gid) {
+    static __thread uid_t last_uid = (uid_t)-1;
+    static __thread gid_t last_gid = (gid_t)-1;
+    if (uid != last_uid) {
+        get_username_cached(uid);
+        last_uid = uid;
+    }
+    if (gid != last_gid) {
+        get_groupname_cached(gid);
+        last_gid = gid;
+    }
+}
+
+static void id_name_cache_free(IdNameCache *c) {
+    for (size_t i = 0; i < c->cap; i++)
+        free((char *)c->slots[i].name);
+    free(c->slots);
+    c->slots = NULL;
+    c->cap = c->count = 0;
+}
+
+void id_names_free(void) {
+    id_name_cache_free(&user_names);
+    id_name_cache_free(&group_names);
+}
+
+#define DIR_CACHE_MAGIC "LSPDSC01"
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t blob_len;
+} DirCacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int64_t own_size;
+    uint64_t names_off;
+    uint32_t names_len;
+    uint32_t nsubdirs;
+} DirCacheRecord;
+
+/* A record stored this run; seq is its place in the order they were
+   queued, so of two updates to one directory the newer wins. */
+typedef struct {
+    DirCacheRecord rec;
+    char *names;
+    uint64_t seq;
+} DirCacheUpdate;
+
+typedef struct {
+    char path[PATH_MAX];
+    void *map;
+    size_t map_len;
+    const DirCacheRecord *records;
+    size_t count;
+    const char *blob;
+    size_t blob_len;
+    DirCacheUpdate *updates;
+    size_t update_count;
+    size_t update_cap;
+    atomic_long hits;
+    atomic_long stale;
+    pthread_mutex_t lock;
+} DirCache;
+
+static DirCache dir_cache;
+
+static int64_t timespec_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int dir_cache_path(char *buf, size_t bufsize, const char *file) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (xdg && xdg[0] == '/')
+        snprintf(dir, sizeof(dir), "%s/lsp", xdg);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.cache/lsp", home);
+    else
+        return -1;
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", dir);
+    char *slash = strrchr(parent, '/');
+    if (slash && slash != parent) {
+        *slash = '\0';
+        mkdir(parent, 0755);
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    if ((size_t)snprintf(buf, bufsize, "%s/%s", dir, file) >= bufsize)
+        return -1;
+    return 0;
+}
+
+static int dir_cache_cmp(const DirCacheRecord *a, const DirCacheRecord *b) {
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    return 0;
+}
+
+static int dir_cache_update_cmp(const void *a, const void *b) {
+    const DirCacheUpdate *ua = (const DirCacheUpdate *)a;
+    const DirCacheUpdate *ub = (const DirCacheUpdate *)b;
+    int c = dir_cache_cmp(&ua->rec, &ub->rec);
+    if (c)
+        return c;
+    return ua->seq < ub->seq ? -1 : ua->seq > ub->seq;
+}
+
+/* Maps the cache file read-only. A missing or malformed file simply starts
+   an empty cache; it is rewritten in full by dir_cache_save. */
+int dir_cache_open(void) {
+    memset(&dir_cache, 0, sizeof(dir_cache));
+    pthread_mutex_init(&dir_cache.lock, NULL);
+    if (dir_cache_path(dir_cache.path, sizeof(dir_cache.path),
+                       opt_allocated ? "dirsizes-allocated" : "dirsizes") < 0)
+        return -1;
+    int fd = open(dir_cache.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(DirCacheHeader)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            const DirCacheHeader *hdr = (const DirCacheHeader *)map;
+            size_t avail = st.st_size - sizeof(DirCacheHeader);
+            if (!memcmp(hdr->magic, DIR_CACHE_MAGIC, 8) &&
+                hdr->count <= avail / sizeof(DirCacheRecord) &&
+                hdr->blob_len <= avail - hdr->count * sizeof(DirCacheRecord)) {
+                dir_cache.map = map;
+                dir_cache.map_len = st.st_size;
+                dir_cache.records = (const DirCacheRecord *)(hdr + 1);
+                dir_cache.count = hdr->count;
+                dir_cache.blob = (const char *)(dir_cache.records + hdr->count);
+                dir_cache.blob_len = hdr->blob_len;
+            } else
+                munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/* Returns the record for st's directory if it has not been modified since it
+   was cached. Changes deeper in the tree are caught when the walk reaches
+   the subdirectory that holds them; in-place file size changes that do not
+   touch any directory need --cache-verify. */
+const DirCacheRecord *dir_cache_lookup(const struct stat *st) {
+    DirCacheRecord key = { .dev = st->st_dev, .ino = st->st_ino };
+    size_t lo = 0, hi = dir_cache.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = dir_cache_cmp(&dir_cache.records[mid], &key);
+        if (c == 0) {
+            const DirCacheRecord *rec = &dir_cache.records[mid];
+            if (rec->mtime_ns != timespec_ns(st->st_mtim) || rec->ctime_ns != timespec_ns(st->st_ctim))
+                return NULL;
+            if (rec->names_off > dir_cache.blob_len || rec->names_len > dir_cache.blob_len - rec->names_off)
+                return NULL;
+            return rec;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+const char *dir_cache_names(const DirCacheRecord *rec) {
+    return dir_cache.blob + rec->names_off;
+}
+
+void dir_cache_store(const struct stat *st, off_t own_size, const char *names, size_t names_len, uint32_t nsubdirs) {
+    char *copy = NULL;
+    if (names_len) {
+        copy = malloc(names_len);
+        if (!copy)
+            return;
+        memcpy(copy, names, names_len);
+    }
+    pthread_mutex_lock(&dir_cache.lock);
+    if (dir_cache.update_count == dir_cache.update_cap) {
+        size_t cap = dir_cache.update_cap ? dir_cache.update_cap * 2 : 256;
+        DirCacheUpdate *tmp = realloc(dir_cache.updates, cap * sizeof(DirCacheUpdate));
+        if (!tmp) {
+            pthread_mutex_unlock(&dir_cache.lock);
+            free(copy);
+            return;
+        }
+        dir_cache.updates = tmp;
+        dir_cache.update_cap = cap;
+    }
+    DirCacheUpdate *u = &dir_cache.updates[dir_cache.update_count];
+    u->seq = dir_cache.update_count++;
+    u->rec.dev = st->st_dev;
+    u->rec.ino = st->st_ino;
+    u->rec.mtime_ns = timespec_ns(st->st_mtim);
+    u->rec.ctime_ns = timespec_ns(st->st_ctim);
+    u->rec.own_size = own_size;
+    u->rec.names_off = 0;
+    u->rec.names_len = names_len;
+    u->rec.nsubdirs = nsubdirs;
+    u->names = copy;
+    pthread_mutex_unlock(&dir_cache.lock);
+}
+
+static int dir_cache_write_record(FILE *f, DirCacheRecord rec, uint64_t *blob_off) {
+    rec.names_off = *blob_off;
+    *blob_off += rec.names_len;
+    return fwrite(&rec, sizeof(rec), 1, f) == 1 ? 0 : -1;
+}
+
+/* Merges this run's records over the mapped ones and atomically replaces the
+   cache file, so concurrent runs only ever see a complete file. */
+int dir_cache_save(void) {
+    if (!dir_cache.path[0])
+        return -1;
+    if (dir_cache.update_count == 0)
+        return 0;
+    qsort(dir_cache.updates, dir_cache.update_count, sizeof(DirCacheUpdate), dir_cache_update_cmp);
+    /* duplicates are adjacent, oldest first; keep the last of each run */
+    size_t n = 0;
+    for (size_t i = 0; i < dir_cache.update_count; i++) {
+        if (n && !dir_cache_cmp(&dir_cache.updates[n - 1].rec, &dir_cache.updates[i].rec)) {
+            free(dir_cache.updates[n - 1].names);
+            dir_cache.updates[n - 1] = dir_cache.updates[i];
+        } else
+            dir_cache.updates[n++] = dir_cache.updates[i];
+    }
+    dir_cache.update_count = n;
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", dir_cache.path, (int)getpid());
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+        return -1;
+    DirCacheHeader hdr;
+    memcpy(hdr.magic, DIR_CACHE_MAGIC, 8);
+    hdr.count = 0;
+    hdr.blob_len = 0;
+    int err = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+    size_t i = 0, j = 0;
+    uint64_t blob_off = 0;
+    while (!err && (i < dir_cache.count || j < n)) {
+        int c;
+        if (i == dir_cache.count)
+            c = 1;
+        else if (j == n)
+            c = -1;
+        else
+            c = dir_cache_cmp(&dir_cache.records[i], &dir_cache.updates[j].rec);
+        if (c < 0)
+            err = dir_cache_write_record(f, dir_cache.records[i++], &blob_off);
+        else {
+            err = dir_cache_write_record(f, dir_cache.updates[j++].rec, &blob_off);
+            if (c == 0)
+                i++;
+        }
+        hdr.count++;
+    }
+    i = j = 0;
+    while (!err && (i < dir_cache.count || j < n)) {
+        int c;
+        if (i == dir_cache.count)
+            c = 1;
+        else if (j == n)
+            c = -1;
+        else
+            c = dir_cache_cmp(&dir_cache.records[i], &dir_cache.updates[j].rec);
+        const char *names;
+        size_t len;
+        if (c < 0) {
+            names = dir_cache.blob + dir_cache.records[i].names_off;
+            len = dir_cache.records[i++].names_len;
+        } else {
+            names = dir_cache.updates[j].names;
+            len = dir_cache.updates[j++].rec.names_len;
+            if (c == 0)
+                i++;
+        }
+        if (len && fwrite(names, 1, len, f) != len)
+            err = 1;
+        hdr.blob_len += len;
+    }
+    if (!err)
+        err = fseek(f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+    if (fclose(f) != 0)
+        err = 1;
+    if (err || rename(tmp_path, dir_cache.path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void dir_cache_close(void) {
+    for (size_t i = 0; i < dir_cache.update_count; i++)
+        free(dir_cache.updates[i].names);
+    free(dir_cache.updates);
+    if (dir_cache.map)
+        munmap(dir_cache.map, dir_cache.map_len);
+    pthread_mutex_destroy(&dir_cache.lock);
+    memset(&dir_cache, 0, sizeof(dir_cache));
+}
+
+int dir_cache_clear(void) {
+    const char *files[] = {"dirsizes", "dirsizes-allocated"};
+    for (int i = 0; i < 2; i++) {
+        char path[PATH_MAX];
+        if (dir_cache_path(path, sizeof(path), files[i]) < 0)
+            return -1;
+        if (unlink(path) < 0 && errno != ENOENT)
+            return -1;
+    }
+    return 0;
+}
+
+#define STAT_BATCH 64
+#define STAT_BATCH_NAMES 8192
+#define URING_MIN_BATCH 4
+
+typedef struct {
+    int count;
+    size_t names_len;
+    unsigned char types[STAT_BATCH];
+    unsigned short name_off[STAT_BATCH];
+    int result[STAT_BATCH];
+    char names[STAT_BATCH_NAMES];
+    struct statx stx[STAT_BATCH];
+} StatBatch;
+
+/* A thread's ring, with the batch it fills; kept off the stack since it
+   is some 25 KB. */
+typedef struct {
+    int fd;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    StatBatch batch;
+} IoRing;
+
+static atomic_int uring_disabled = 0;
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static void io_ring_free(void *arg) {
+    IoRing *ring = (IoRing *)arg;
+    if (!ring)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+static void uring_key_init(void) {
+    pthread_key_create(&uring_key, io_ring_free);
+}
+
+static int io_ring_supports_statx(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe)
+        return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_STATX &&
+             (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static IoRing *io_ring_setup(void) {
+    IoRing *ring = calloc(1, sizeof(IoRing));
+    if (!ring)
+        return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, STAT_BATCH, &p);
+    if (ring->fd < 0 || !io_ring_supports_statx(ring->fd)) {
+        io_ring_free(ring);
+        return NULL;
+    }
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        io_ring_free(ring);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            io_ring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        io_ring_free(ring);
+        return NULL;
+    }
+    char *sq = (char *)ring->sq_ptr;
+    char *cq = (char *)ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return ring;
+}
+
+/* Each thread lazily gets its own ring. If io_uring cannot be set up (old
+   kernel, seccomp, no IORING_OP_STATX) it is disabled process-wide and
+   callers fall back to plain stat(). */
+static IoRing *io_ring_get(void) {
+    if (atomic_load(&uring_disabled))
+        return NULL;
+    pthread_once(&uring_key_once, uring_key_init);
+    IoRing *ring = pthread_getspecific(uring_key);
+    if (ring)
+        return ring;
+    ring = io_ring_setup();
+    if (!ring) {
+        atomic_store(&uring_disabled, 1);
+        return NULL;
+    }
+    pthread_setspecific(uring_key, ring);
+    return ring;
+}
+
+static int stat_batch_full(const StatBatch *b, const char *name) {
+    return b->count == STAT_BATCH || b->names_len + strlen(name) + 1 > STAT_BATCH_NAMES;
+}
+
+static void stat_batch_add(StatBatch *b, const char *name, unsigned char type) {
+    size_t len = strlen(name) + 1;
+    memcpy(b->names + b->names_len, name, len);
+    b->name_off[b->count] = b->names_len;
+    b->types[b->count] = type;
+    b->names_len += len;
+    b->count++;
+}
+
+/* Submits one IORING_OP_STATX per batched name relative to dirfd and waits
+   for all completions with a single io_uring_enter. */
+static int stat_batch_submit(IoRing *ring, int dirfd, StatBatch *b, unsigned mask) {
+    unsigned tail = *ring->sq_tail;
+    for (int i = 0; i < b->count; i++) {
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)(b->names + b->name_off[i]);
+        sqe->len = mask;
+        sqe->off = (uint64_t)(uintptr_t)&b->stx[i];
+        sqe->statx_flags = opt_statx_sync;
+        sqe->user_data = i;
+        ring->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    stats_calls(SC_URING_STATX, b->count);
+    int submitted = 0, completed = 0;
+    while (completed < b->count) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, b->count - submitted,
+                          b->count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_calls(SC_URING_ENTER, 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        submitted += ret;
+        unsigned head = *ring->cq_head;
+        unsigned ctail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != ctail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < (uint64_t)b->count)
+                b->result[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+#define TASK_QUEUE_SIZE 4096
+
+typedef struct Task {
+    void (*function)(void *);
+    void *arg;
+    uint64_t queued_at;
+} Task;
+
+typedef struct TaskDeque {
+    Task *items;
+    size_t cap;
+    size_t top;
+    size_t bottom;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+/* Bounded multi-producer/multi-consumer ring (Vyukov). Each cell carries a
+   sequence number that tells producers and consumers whose turn it is, so
+   the shared queue needs no lock. */
+typedef struct {
+    atomic_size_t seq;
+    Task task;
+} TaskCell;
+
+typedef struct {
+    TaskCell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} TaskQueue;
+
+struct ThreadPool;
+
+typedef struct Worker {
+    struct ThreadPool *pool;
+    int index;
+    TaskDeque deque;
+} Worker;
+
+typedef struct ThreadPool {
+    pthread_t *threads;
+    Worker *workers;
+    int num_threads;
+    TaskQueue queue;
+    TaskDeque overflow;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+    atomic_long tasks_queued;
+    atomic_long tasks_pending;
+    atomic_int idle_workers;
+    pthread_cond_t tasks_done;
+} ThreadPool;
+
+static __thread Worker *current_worker = NULL;
+
+static int task_queue_init(TaskQueue *q, size_t size) {
+    q->cells = malloc(size * sizeof(TaskCell));
+    if (!q->cells)
+        return -1;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
+}
+
+static int task_queue_push(TaskQueue *q, Task task) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        TaskCell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->task = task;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+}
+
+static int task_queue_pop(TaskQueue *q, Task *task) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        TaskCell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *task = cell->task;
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+}
+
+static int task_deque_init(TaskDeque *dq) {
+    dq->cap = 64;
+    dq->top = dq->bottom = 0;
+    dq->items = malloc(dq->cap * sizeof(Task));
+    if (!dq->items)
+        return -1;
+    pthread_mutex_init(&dq->lock, NULL);
+    return 0;
+}
+
+static void task_deque_destroy(TaskDeque *dq) {
+    free(dq->items);
+    pthread_mutex_destroy(&dq->lock);
+}
+
+static int task_deque_push(TaskDeque *dq, Task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top == dq->cap) {
+        size_t new_cap = dq->cap * 2;
+        Task *items = malloc(new_cap * sizeof(Task));
+        if (!items) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = dq->top; i < dq->bottom; i++)
+            items[i - dq->top] = dq->items[i % dq->cap];
+        free(dq->items);
+        dq->items = items;
+        dq->bottom -= dq->top;
+        dq->top = 0;
+        dq->cap = new_cap;
+    }
+    dq->items[dq->bottom % dq->cap] = task;
+    dq->bottom++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* The owner pops the newest task (depth-first), thieves take the oldest,
+   which near the root of a walk is also the largest remaining subtree. */
+static int task_deque_pop(TaskDeque *dq, Task *task) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        dq->bottom--;
+        *task = dq->items[dq->bottom % dq->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/* Oldest task, waiting for the lock unlike task_deque_steal. */
+static int task_deque_shift(TaskDeque *dq, Task *task) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *task = dq->items[dq->top % dq->cap];
+        dq->top++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int task_deque_steal(TaskDeque *dq, Task *task) {
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0)
+        return 0;
+    if (dq->bottom > dq->top) {
+        *task = dq->items[dq->top % dq->cap];
+        dq->top++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int thread_pool_take(Worker *w, Task *task) {
+    ThreadPool *pool = w->pool;
+    int found = task_deque_pop(&w->deque, task) || task_queue_pop(&pool->queue, task) == 0 ||
+                task_deque_shift(&pool->overflow, task);
+    for (int i = 1; !found && i < pool->num_threads; i++)
+        found = task_deque_steal(&pool->workers[(w->index + i) % pool->num_threads].deque, task);
+    if (found)
+        atomic_fetch_sub(&pool->tasks_queued, 1);
+    return found;
+}
+
+static void thread_pool_task_done(ThreadPool *pool) {
+    if (atomic_fetch_sub(&pool->tasks_pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->tasks_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *thread_pool_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    ThreadPool *pool = w->pool;
+    ThreadStats *ts = opt_stats ? stats_self() : NULL;
+    current_worker = w;
+    if (ts)
+        ts->worker = w->index;
+    while (1) {
+        Task task;
+        if (thread_pool_take(w, &task)) {
+            if (ts) {
+                uint64_t start = monotonic_ns();
+                ts->queue_wait_ns += start - task.queued_at;
+                task.function(task.arg);
+                ts->busy_ns += monotonic_ns() - start;
+                ts->tasks++;
+            } else
+                task.function(task.arg);
+            thread_pool_task_done(pool);
+            continue;
+        }
+        uint64_t idle_start = stats_clock();
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->idle_workers, 1);
+        while (atomic_load(&pool->tasks_queued) <= 0 && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        atomic_fetch_sub(&pool->idle_workers, 1);
+        int done = pool->stop && atomic_load(&pool->tasks_queued) <= 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (ts)
+            ts->idle_ns += monotonic_ns() - idle_start;
+        if (done)
+            break;
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+/* Number of workers: LSP_THREADS if set, otherwise the CPUs this process
+   may run on. */
+int thread_pool_default_size(void) {
+    const char *env = getenv("LSP_THREADS");
+    if (env && atoi(env) > 0)
+        return atoi(env);
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+ThreadPool *thread_pool_create(int num_threads) {
+    ThreadPool *pool = aligned_alloc(_Alignof(ThreadPool), sizeof(ThreadPool));
+    if (!pool)
+        return NULL;
+    pool->num_threads = num_threads;
+    pool->stop = 0;
+    atomic_init(&pool->tasks_queued, 0);
+    atomic_init(&pool->tasks_pending, 0);
+    atomic_init(&pool->idle_workers, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->tasks_done, NULL);
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    pool->workers = calloc(num_threads, sizeof(Worker));
+    if (!pool->threads || !pool->workers || task_queue_init(&pool->queue, TASK_QUEUE_SIZE) < 0) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    if (task_deque_init(&pool->overflow) < 0) {
+        free(pool->queue.cells);
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (task_deque_init(&pool->workers[i].deque) < 0) {
+            while (i--)
+                task_deque_destroy(&pool->workers[i].deque);
+            task_deque_destroy(&pool->overflow);
+            free(pool->queue.cells);
+            free(pool->threads);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, &pool->workers[i]) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->stop = 1;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            while (i--)
+                pthread_join(pool->threads[i], NULL);
+            for (int j = 0; j < num_threads; j++)
+                task_deque_destroy(&pool->workers[j].deque);
+            task_deque_destroy(&pool->overflow);
+            free(pool->queue.cells);
+            free(pool->threads);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/* Tasks submitted from one of the pool's own workers go onto that worker's
+   deque, where idle workers can steal them; anything else goes through the
+   shared ring. When the ring is full tasks go on the overflow list. A task
+   is never run by its submitter: size jobs spawn their subdirectories, so
+   running inline would recurse once per directory level. */
+void thread_pool_add_task(ThreadPool *pool, void (*function)(void *), void *arg) {
+    Task task = { function, arg, stats_clock() };
+    Worker *w = current_worker;
+    atomic_fetch_add(&pool->tasks_pending, 1);
+    int queued = (w && w->pool == pool) ? task_deque_push(&w->deque, task) == 0
+                                        : task_queue_push(&pool->queue, task) == 0;
+    if (!queued)
+        queued = task_deque_push(&pool->overflow, task) == 0;
+    /* out of memory for the overflow list: wait for room in the ring */
+    while (!queued) {
+        sched_yield();
+        queued = task_queue_push(&pool->queue, task) == 0;
+    }
+    atomic_fetch_add(&pool->tasks_queued, 1);
+    if (atomic_load(&pool->idle_workers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->tasks_pending) > 0)
+        pthread_cond_wait(&pool->tasks_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Returns 1 once every task has finished, 0 if ms elapsed first. */
+int thread_pool_wait_timeout(ThreadPool *pool, long ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int done = 1;
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->tasks_pending) > 0) {
+        if (pthread_cond_timedwait(&pool->tasks_done, &pool->lock, &deadline) == ETIMEDOUT) {
+            done = atomic_load(&pool->tasks_pending) == 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->num_threads; i++)
+        task_deque_destroy(&pool->workers[i].deque);
+    task_deque_destroy(&pool->overflow);
+    free(pool->queue.cells);
+    free(pool->threads);
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    pthread_cond_destroy(&pool->tasks_done);
+    free(pool);
+}
+
+static ThreadPool *worker_pool = NULL;
+
+/* Outstanding work of one listing: its entry tasks and size walks, plus a
+   reference held while the listing is set up. Several listings share the
+   pool, so each is waited for on its own. on_done runs on the thread that
+   finishes the last piece, before waiters are woken. */
+typedef struct TaskGroup {
+    atomic_long pending;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*on_done)(void *ctx);
+    void *ctx;
+} TaskGroup;
+
+void task_group_init(TaskGroup *g) {
+    atomic_init(&g->pending, 1);
+    g->done = 0;
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    g->on_done = NULL;
+    g->ctx = NULL;
+}
+
+void task_group_add(TaskGroup *g) {
+    atomic_fetch_add(&g->pending, 1);
+}
+
+void task_group_release(TaskGroup *g) {
+    if (atomic_fetch_sub(&g->pending, 1) != 1)
+        return;
+    if (g->on_done)
+        g->on_done(g->ctx);
+    pthread_mutex_lock(&g->lock);
+    g->done = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+void task_group_wait(TaskGroup *g) {
+    pthread_mutex_lock(&g->lock);
+    while (!g->done)
+        pthread_cond_wait(&g->cond, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
+
+void task_group_destroy(TaskGroup *g) {
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->cond);
+}
+
+/* Settings every size walk of one listing shares. deadline is when the
+   --deadline budget runs out (0 for none), fs_dev the device -x keeps the
+   walks on, and rank the length of the listing's real path, see Claim. */
+typedef struct WalkScope {
+    uint64_t deadline;
+    dev_t fs_dev;
+    size_t rank;
+    TaskGroup *group;
+    struct Claim *claim;
+    _Atomic(struct SizeJob *) *tree;
+} WalkScope;
+
+/* One recursive size computation. pending counts the walk's queued and
+   running tasks plus one reference held by whoever started it; on_done runs
+   on the thread that drops it to zero, once *total is final. */
+typedef struct WalkRoot {
+    off_t *total;
+    const WalkScope *scope;
+    atomic_long pending;
+    atomic_int truncated;
+    atomic_ullong scan_ns;
+    void (*on_done)(struct WalkRoot *root);
+    void *ctx;
+} WalkRoot;
+
+void walk_root_init(WalkRoot *root, const WalkScope *scope, off_t *total, void (*on_done)(WalkRoot *), void *ctx) {
+    root->total = total;
+    root->scope = scope;
+    atomic_init(&root->pending, 1);
+    atomic_init(&root->truncated, 0);
+    atomic_init(&root->scan_ns, 0);
+    root->on_done = on_done;
+    root->ctx = ctx;
+    if (scope->group)
+        task_group_add(scope->group);
+}
+
+/* True once the listing has used up its --deadline budget. The caller stops
+   descending, and the total becomes a lower bound. */
+static int walk_root_expired(WalkRoot *root) {
+    uint64_t deadline = root->scope->deadline;
+    if (!deadline || monotonic_ns() < deadline)
+        return 0;
+    atomic_store_explicit(&root->truncated, 1, memory_order_relaxed);
+    return 1;
+}
+
+void walk_root_release(WalkRoot *root) {
+    if (atomic_fetch_sub(&root->pending, 1) != 1)
+        return;
+    TaskGroup *group = root->scope->group;
+    if (root->on_done)
+        root->on_done(root);
+    if (group)
+        task_group_release(group);
+}
+
+/* Set once any walk error was reported; the run then exits with status 1,
+   as du does. */
+static atomic_int walk_errors;
+
+/* Reports a file or directory a size walk could not read, as du does. The
+   total it belongs to is then only a lower bound. path is dir/rel, with
+   rel's components separated by NULs. */
+static void walk_error(const char *what, const char *dir, const char *rel, size_t rel_len, int err) {
+    size_t dir_len = dir ? strlen(dir) + 1 : 0;
+    char *path = malloc(dir_len + rel_len + 1);
+    if (path) {
+        if (dir) {
+            memcpy(path, dir, dir_len - 1);
+            path[dir_len - 1] = '/';
+        }
+        for (size_t i = 0; i < rel_len; i++)
+            path[dir_len + i] = rel[i] ? rel[i] : '/';
+        path[dir_len + rel_len] = '\0';
+    }
+    fprintf(stderr, "lsp: cannot %s %s: %s\n", what, path ? path : rel, strerror(err));
+    free(path);
+    atomic_store_explicit(&walk_errors, 1, memory_order_relaxed);
+}
+
+/* Opens the directory reached from base through count components. Only
+   the last one is opened for reading; the ones before it use O_PATH. */
+static int open_components(int base, const char *const *names, size_t count) {
+    int fd = base;
+    for (size_t i = 0; i < count; i++) {
+        int next = openat(fd, names[i], (i + 1 < count ? O_PATH : O_RDONLY) | O_DIRECTORY | O_CLOEXEC);
+        int err = errno;
+        stats_calls(SC_OPEN, 1);
+        if (fd != base)
+            close(fd);
+        if (next < 0) {
+            errno = err;
+            return -1;
+        }
+        fd = next;
+    }
+    return fd;
+}
+
+static int grow(void *pp, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap)
+        return 0;
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need)
+        new_cap *= 2;
+    void *p = realloc(*(void **)pp, new_cap * size);
+    if (!p)
+        return -1;
+    *(void **)pp = p;
+    *cap = new_cap;
+    return 0;
+}
+
+#define WALK_OPEN_FDS 16
+
+/* Directory fds held by pool size walks, and how many they may hold
+   before new jobs stop pinning their parent's fd; set in main from
+   RLIMIT_NOFILE less the fds the rest of the process needs. */
+static atomic_int walk_fds_open;
+static int walk_fd_budget = 512;
+
+/* A directory on the walker's stack. name is the offset of its component
+   in Walker.names, pending the index in Walker.todo of its first subdir
+   still to visit. fd is -1 once the directory no longer needs it, or while
+   it is closed to stay within WALK_OPEN_FDS. */
+typedef struct {
+    int fd;
+    size_t name;
+    size_t pending;
+} WalkFrame;
+
+/* State of one iterative walk. Memory is the names of the directories on
+   the current path plus their unvisited subdirectories; files are summed
+   as they are read, and every directory is read in full and released
+   before the walk moves on, so one getdents buffer serves the whole walk. */
+typedef struct {
+    const WalkScope *scope;
+    const char *dir;
+    int base;
+    WalkFrame *frames;
+    size_t depth, frames_cap;
+    char *names;
+    size_t names_len, names_cap;
+    char *todo;
+    size_t todo_len, todo_cap;
+    size_t *todo_off;
+    size_t todo_count, todo_off_cap;
+    size_t open, lo;
+    off_t total;
+    int partial;
+    size_t entries, nstat;
+} Walker;
+
+static int walker_expired(Walker *w) {
+    if (!w->scope->deadline || monotonic_ns() < w->scope->deadline)
+        return 0;
+    w->partial = 1;
+    return 1;
+}
+
+static void walker_error(Walker *w, const char *what, const char *name, int err) {
+    size_t len = w->names_len;
+    if (name && !grow(&w->names, &w->names_cap, len + strlen(name) + 1, 1)) {
+        memcpy(w->names + len, name, strlen(name) + 1);
+        len += strlen(name) + 1;
+    }
+    walk_error(what, w->dir, w->names, len ? len - 1 : 0, err);
+    w->partial = 1;
+}
+
+static void walker_close(Walker *w, WalkFrame *f) {
+    if (f->fd < 0)
+        return;
+    close(f->fd);
+    f->fd = -1;
+    w->open--;
+}
+
+/* Reopens a frame closed for the fd budget, from its nearest open
+   ancestor or the walk's base. */
+static int walker_reopen(Walker *w, size_t d) {
+    size_t from = d;
+    while (from > 0 && w->frames[from - 1].fd < 0)
+        from--;
+    int base = from > 0 ? w->frames[from - 1].fd : w->base;
+    const char **comps = malloc((d - from + 1) * sizeof(char *));
+    if (!comps)
+        return -1;
+    for (size_t i = from; i <= d; i++)
+        comps[i - from] = w->names + w->frames[i].name;
+    w->frames[d].fd = open_components(base, comps, d - from + 1);
+    free(comps);
+    if (w->frames[d].fd < 0)
+        return -1;
+    w->open++;
+    w->lo = 0;
+    return 0;
+}
+
+static int walker_push_todo(Walker *w, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (grow(&w->todo, &w->todo_cap, w->todo_len + len, 1) < 0 ||
+        grow(&w->todo_off, &w->todo_off_cap, w->todo_count + 1, sizeof(size_t)) < 0)
+        return -1;
+    memcpy(w->todo + w->todo_len, name, len);
+    w->todo_off[w->todo_count++] = w->todo_len;
+    w->todo_len += len;
+    return 0;
+}
+
+/* Sums the files of the directory on top of the stack and queues its
+   subdirectories. */
+static void walker_read(Walker *w) {
+    int fd = w->frames[w->depth - 1].fd;
+    DirReader reader;
+    if (dir_reader_init(&reader, fd) < 0) {
+        walker_error(w, "read directory", NULL, ENOMEM);
+        return;
+    }
+    struct linux_dirent64 *entry;
+    unsigned seen = 0;
+    while ((entry = dir_reader_next(&reader)) != NULL) {
+        if (is_dot_or_dotdot(entry->d_name) || name_excluded(entry->d_name))
+            continue;
+        if (++seen % 64 == 0 && walker_expired(w))
+            break;
+        w->entries++;
+        if (entry->d_type == DT_DIR) {
+            if (walker_push_todo(w, entry->d_name) < 0)
+                walker_error(w, "read directory", entry->d_name, ENOMEM);
+            continue;
+        }
+        struct stat st;
+        w->nstat++;
+        if (stat_at(fd, entry->d_name, 0, size_stat_mask(), &st) != 0) {
+            if (errno != ENOENT)
+                walker_error(w, "stat", entry->d_name, errno);
+            continue;
+        }
+        if (entry->d_type == DT_UNKNOWN && S_ISDIR(st.st_mode)) {
+            if (walker_push_todo(w, entry->d_name) < 0)
+                walker_error(w, "read directory", entry->d_name, ENOMEM);
+        } else
+            w->total += stat_accounted_size(&st);
+    }
+    if (reader.error)
+        walker_error(w, "read directory", NULL, reader.error);
+    dir_reader_release(&reader);
+}
+
+/* Opens name under parent_fd as a new frame and reads it. */
+static void walker_enter(Walker *w, int parent_fd, const char *name) {
+    size_t name_off = w->names_len;
+    size_t len = strlen(name) + 1;
+    if (grow(&w->names, &w->names_cap, name_off + len, 1) < 0 ||
+        grow(&w->frames, &w->frames_cap, w->depth + 1, sizeof(WalkFrame)) < 0) {
+        walker_error(w, "read directory", name, ENOMEM);
+        return;
+    }
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_calls(SC_OPEN, 1);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            walker_error(w, "open directory", name, errno);
+        return;
+    }
+    struct stat dst;
+    if (opt_one_fs && stat_at(fd, "", AT_EMPTY_PATH, STATX_TYPE, &dst) == 0 && dst.st_dev != w->scope->fs_dev) {
+        close(fd);
+        return;
+    }
+    memcpy(w->names + name_off, name, len);
+    w->names_len += len;
+    w->frames[w->depth++] = (WalkFrame){ fd, name_off, w->todo_count };
+    w->open++;
+    while (w->open > WALK_OPEN_FDS && w->lo < w->depth - 1) {
+        walker_close(w, &w->frames[w->lo]);
+        w->lo++;
+    }
+    walker_read(w);
+    if (w->todo_count == w->frames[w->depth - 1].pending)
+        walker_close(w, &w->frames[w->depth - 1]);
+}
+
+/* Size of name under dirfd, walked iteratively relative to each
+   directory's fd: no recursion on the C stack, at most WALK_OPEN_FDS
+   descriptors, and no PATH_MAX limit on depth. Entries that cannot be read
+   are reported on stderr and set *partial; so does running out of the
+   scope's --deadline. dir is the display path of dirfd, or NULL. */
+off_t get_directory_size(int dirfd, const char *name, const WalkScope *scope, const char *dir, int *partial) {
+    Walker w = {0};
+    w.scope = scope;
+    w.dir = dir;
+    w.base = dirfd;
+    walker_enter(&w, dirfd, name);
+    while (w.depth > 0) {
+        WalkFrame *f = &w.frames[w.depth - 1];
+        if (w.todo_count == f->pending || walker_expired(&w)) {
+            walker_close(&w, f);
+            w.names_len = f->name;
+            w.todo_count = f->pending;
+            w.todo_len = w.todo_count ? w.todo_off[w.todo_count - 1] + strlen(w.todo + w.todo_off[w.todo_count - 1]) + 1 : 0;
+            w.depth--;
+            if (w.lo > w.depth)
+                w.lo = w.depth;
+            continue;
+        }
+        if (f->fd < 0 && walker_reopen(&w, w.depth - 1) < 0) {
+            walker_error(&w, "open directory", NULL, errno);
+            w.todo_count = f->pending;
+            continue;
+        }
+        /* the name stays in todo until the child is entered; the parent's fd
+           is dropped once its last subdirectory is taken */
+        size_t off = w.todo_off[w.todo_count - 1];
+        int parent_fd = f->fd;
+        w.todo_count--;
+        int last = w.todo_count == f->pending;
+        if (last)
+            f->fd = -1;
+        size_t depth = w.depth;
+        walker_enter(&w, parent_fd, w.todo + off);
+        if (w.depth == depth)
+            w.todo_len = off;
+        if (last) {
+            close(parent_fd);
+            w.open--;
+        }
+    }
+    free(w.frames);
+    free(w.names);
+    free(w.todo);
+    free(w.todo_off);
+    stats_calls(SC_STAT, w.nstat);
+    stats_visit(1, w.entries);
+    if (partial && w.partial)
+        *partial = 1;
+    return w.total;
+}
+
+/* One directory of a size walk. A job opens its directory relative to its
+   parent's fd, which stays open while fd_users counts children that have
+   not opened theirs yet; a root job opens name relative to base_fd, whose
+   display path is dir. Jobs are kept until their whole subtree is summed,
+   so --top knows directory totals and paths can be rebuilt from the names
+   when one has to be shown. With --tree, jobs within --max-depth are kept
+   after that as the nodes of the tree, linked to their parent's children
+   and holding their files. A job spawned while walk_fds_open is over
+   walk_fd_budget does not hold its parent's fd and opens itself from the
+   root's base_fd through the chain of names instead. */
+typedef struct SizeJob {
+    ThreadPool *pool;
+    WalkRoot *root;
+    dev_t dev;
+    struct DevGate *gate;
+    struct SizeJob *next;
+    struct SizeJob *parent;
+    atomic_long pending;
+    atomic_llong subtotal;
+    atomic_int fd_users;
+    atomic_int truncated;
+    int fd;
+    int base_fd;
+    int via_parent;
+    int depth;
+    int kept;
+    struct SizeJob *children;
+    struct SizeJob *sibling;
+    struct TreeFile *files;
+    const char *dir;
+    char name[];
+} SizeJob;
+
+int opt_tree = 0;
+int opt_tree_depth = 0;
+off_t opt_min_size = 0;
+
+/* A file shown by --tree, on the list of its directory's job. */
+typedef struct TreeFile {
+    struct TreeFile *next;
+    off_t size;
+    char name[];
+} TreeFile;
+
+/* Files deeper than --max-depth or smaller than --min-size are never
+   shown, so they are not kept. Only the thread scanning job adds to it. */
+static void tree_note_file(SizeJob *job, const char *name, off_t size) {
+    if (!job->kept || (opt_tree_depth && job->depth >= opt_tree_depth) || size < opt_min_size)
+        return;
+    size_t len = strlen(name);
+    TreeFile *f = malloc(sizeof(TreeFile) + len + 1);
+    if (!f)
+        return;
+    f->size = size;
+    memcpy(f->name, name, len + 1);
+    f->next = job->files;
+    job->files = f;
+}
+
+static void tree_files_free(TreeFile *f) {
+    while (f) {
+        TreeFile *next = f->next;
+        free(f);
+        f = next;
+    }
+}
+
+/* Frees the jobs on a sibling list and everything below them, splicing
+   each job's children into the list instead of recursing. */
+static void tree_free(SizeJob *job) {
+    while (job) {
+        SizeJob *next = job->sibling;
+        if (job->children) {
+            SizeJob *last = job->children;
+            while (last->sibling)
+                last = last->sibling;
+            last->sibling = next;
+            next = job->children;
+        }
+        tree_files_free(job->files);
+        free(job);
+        job = next;
+    }
+}
+
+/* Display path of name inside job, or of job itself when name is NULL.
+   Built from the parent chain, so it is not bounded by PATH_MAX. */
+static char *size_job_path(const SizeJob *job, const char *name) {
+    size_t len = name ? strlen(name) + 1 : 0;
+    const SizeJob *j;
+    for (j = job; j->parent; j = j->parent)
+        len += strlen(j->name) + 1;
+    len += strlen(j->name) + (j->dir ? strlen(j->dir) + 1 : 0);
+    char *path = malloc(len + 1);
+    if (!path)
+        return NULL;
+    char *p = path + len;
+    *p = '\0';
+    if (name) {
+        p -= strlen(name);
+        memcpy(p, name, strlen(name));
+        *--p = '/';
+    }
+    for (j = job;; j = j->parent) {
+        p -= strlen(j->name);
+        memcpy(p, j->name, strlen(j->name));
+        if (!j->parent)
+            break;
+        *--p = '/';
+    }
+    if (j->dir) {
+        *--p = '/';
+        memcpy(path, j->dir, strlen(j->dir));
+    }
+    return path;
+}
+
+static void size_job_error(SizeJob *job, const char *what, const char *name, int err) {
+    char *path = size_job_path(job, name);
+    fprintf(stderr, "lsp: cannot %s %s: %s\n", what, path ? path : name ? name : job->name, strerror(err));
+    free(path);
+    atomic_store_explicit(&walk_errors, 1, memory_order_relaxed);
+    atomic_store_explicit(&job->root->truncated, 1, memory_order_relaxed);
+    atomic_store_explicit(&job->truncated, 1, memory_order_relaxed);
+}
+
+/* walk_root_expired, also marking job's own total as a lower bound. */
+static int size_job_expired(SizeJob *job) {
+    if (!walk_root_expired(job->root))
+        return 0;
+    atomic_store_explicit(&job->truncated, 1, memory_order_relaxed);
+    return 1;
+}
+
+size_t opt_top = 0;
+
+typedef struct TopItem {
+    off_t size;
+    char *path;
+} TopItem;
+
+/* Min-heap of the opt_top largest items seen by one thread. */
+typedef struct TopHeap {
+    TopItem *items;
+    size_t count;
+} TopHeap;
+
+typedef struct TopHeaps {
+    TopHeap files;
+    TopHeap dirs;
+    struct TopHeaps *next;
+} TopHeaps;
+
+static __thread TopHeaps *thread_top = NULL;
+static TopHeaps *all_top = NULL;
+static pthread_mutex_t top_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TopHeaps *top_self(void) {
+    if (!thread_top) {
+        TopHeaps *t = calloc(1, sizeof(TopHeaps));
+        if (!t)
+            return NULL;
+        t->files.items = malloc(opt_top * sizeof(TopItem));
+        t->dirs.items = malloc(opt_top * sizeof(TopItem));
+        if (!t->files.items || !t->dirs.items) {
+            free(t->files.items);
+            free(t->dirs.items);
+            free(t);
+            return NULL;
+        }
+        pthread_mutex_lock(&top_lock);
+        t->next = all_top;
+        all_top = t;
+        pthread_mutex_unlock(&top_lock);
+        thread_top = t;
+    }
+    return thread_top;
+}
+
+static void top_sift_down(TopHeap *h, size_t i) {
+    while (1) {
+        size_t l = 2 * i + 1, m = i;
+        if (l < h->count && h->items[l].size < h->items[m].size)
+            m = l;
+        if (l + 1 < h->count && h->items[l + 1].size < h->items[m].size)
+            m = l + 1;
+        if (m == i)
+            return;
+        TopItem tmp = h->items[i];
+        h->items[i] = h->items[m];
+        h->items[m] = tmp;
+        i = m;
+    }
+}
+
+/* Paths are only built for items that make it into the heap. */
+static int top_admits(const TopHeap *h, off_t size) {
+    return h->count < opt_top || size > h->items[0].size;
+}
+
+/* Adds copy, which h takes over, evicting the smallest item once full. */
+static void top_push(TopHeap *h, char *copy, off_t size) {
+    if (!copy)
+        return;
+    if (h->count < opt_top) {
+        size_t i = h->count++;
+        while (i > 0 && h->items[(i - 1) / 2].size > size) {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->items[i] = (TopItem){ size, copy };
+        return;
+    }
+    free(h->items[0].path);
+    h->items[0] = (TopItem){ size, copy };
+    top_sift_down(h, 0);
+}
+
+static void top_note_file(const char *dir, const char *name, off_t size) {
+    TopHeaps *t = top_self();
+    if (!t || !top_admits(&t->files, size))
+        return;
+    size_t dir_len = dir ? strlen(dir) + 1 : 0;
+    char *path = malloc(dir_len + strlen(name) + 1);
+    if (path && dir) {
+        memcpy(path, dir, dir_len - 1);
+        path[dir_len - 1] = '/';
+    }
+    if (path)
+        strcpy(path + dir_len, name);
+    top_push(&t->files, path, size);
+}
+
+static void top_note_job_file(const SizeJob *job, const char *name, off_t size) {
+    TopHeaps *t = top_self();
+    if (t && top_admits(&t->files, size))
+        top_push(&t->files, size_job_path(job, name), size);
+}
+
+/* Adds sum to job; once it and all its subdirectories are done, records its
+   total for --top and passes it up, freeing finished jobs on the way. */
+static void size_job_done(SizeJob *job, off_t sum) {
+    atomic_fetch_add(&job->subtotal, sum);
+    while (job && atomic_fetch_sub(&job->pending, 1) == 1) {
+        off_t total = atomic_load(&job->subtotal);
+        TopHeaps *t = opt_top ? top_self() : NULL;
+        if (t && top_admits(&t->dirs, total))
+            top_push(&t->dirs, size_job_path(job, NULL), total);
+        SizeJob *parent = job->parent;
+        if (parent) {
+            if (atomic_load_explicit(&job->truncated, memory_order_relaxed))
+                atomic_store_explicit(&parent->truncated, 1, memory_order_relaxed);
+            atomic_fetch_add(&parent->subtotal, total);
+        }
+        if (!job->kept)
+            free(job);
+        else if (total < opt_min_size) {
+            /* nothing below a directory too small to show is shown */
+            tree_free(job->children);
+            tree_files_free(job->files);
+            job->children = NULL;
+            job->files = NULL;
+        }
+        job = parent;
+    }
+}
+
+static void size_job_task(void *arg);
+
+#define DEV_GATES 64
+#define SLOW_OP_NS 500000
+
+/* Admission control for size jobs on one device. The limit starts at the
+   pool size, where the gate never engages; --device-jobs or a device whose
+   directory reads turn out slow lowers it, and jobs over the limit wait on
+   the deferred list instead of occupying a worker. A slow device gets the
+   full pool back once its reads speed up again. active counts every job
+   running on the device, including those admitted while the gate was
+   open, so a limit that drops mid-walk holds from the next job on. */
+typedef struct DevGate {
+    atomic_int used;
+    dev_t dev;
+    atomic_int limit;
+    atomic_ullong op_ns;
+    atomic_int active;
+    atomic_int waiting;
+    pthread_mutex_t lock;
+    SizeJob *deferred;
+    SizeJob *deferred_tail;
+} DevGate;
+
+static DevGate dev_gates[DEV_GATES];
+static pthread_mutex_t dev_gates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static DevGate *dev_gate_get(dev_t dev, int threads) {
+    size_t start = (size_t)(dev * 0x9e3779b97f4a7c15ULL >> 58) % DEV_GATES;
+    for (size_t n = 0; n < DEV_GATES; n++) {
+        DevGate *g = &dev_gates[(start + n) % DEV_GATES];
+        if (atomic_load_explicit(&g->used, memory_order_acquire)) {
+            if (g->dev == dev)
+                return g;
+            continue;
+        }
+        pthread_mutex_lock(&dev_gates_lock);
+        if (atomic_load_explicit(&g->used, memory_order_relaxed)) {
+            pthread_mutex_unlock(&dev_gates_lock);
+            if (g->dev == dev)
+                return g;
+            continue;
+        }
+        g->dev = dev;
+        atomic_init(&g->limit, opt_device_jobs ? opt_device_jobs : threads);
+        atomic_init(&g->op_ns, 0);
+        pthread_mutex_init(&g->lock, NULL);
+        atomic_init(&g->active, 0);
+        atomic_init(&g->waiting, 0);
+        g->deferred = g->deferred_tail = NULL;
+        atomic_store_explicit(&g->used, 1, memory_order_release);
+        pthread_mutex_unlock(&dev_gates_lock);
+        return g;
+    }
+    return NULL;
+}
+
+/* Returns 0 if the job was parked on its device's deferred list; it is
+   resubmitted, already admitted, when a job on that device leaves. */
+static int dev_gate_enter(SizeJob *job) {
+    if (job->gate)
+        return 1;
+    DevGate *g = dev_gate_get(job->dev, job->pool->num_threads);
+    if (!g)
+        return 1;
+    job->gate = g;
+    if (atomic_load(&g->limit) >= job->pool->num_threads && !atomic_load(&g->waiting)) {
+        atomic_fetch_add(&g->active, 1);
+        return 1;
+    }
+    pthread_mutex_lock(&g->lock);
+    /* waiting is raised before active is read, and dev_gate_leave lowers
+       active before reading waiting, so one of the two sees the other */
+    atomic_fetch_add(&g->waiting, 1);
+    if (atomic_load(&g->active) < atomic_load(&g->limit)) {
+        atomic_fetch_sub(&g->waiting, 1);
+        atomic_fetch_add(&g->active, 1);
+        pthread_mutex_unlock(&g->lock);
+        return 1;
+    }
+    job->next = NULL;
+    if (g->deferred_tail)
+        g->deferred_tail->next = job;
+    else
+        g->deferred = job;
+    g->deferred_tail = job;
+    pthread_mutex_unlock(&g->lock);
+    return 0;
+}
+
+/* Feeds the per-entry cost of a directory read into the device's moving
+   average, throttling the device to half the pool while it looks slow, and
+   hands freed slots to deferred jobs. */
+static void dev_gate_leave(SizeJob *job, uint64_t elapsed_ns, size_t ops) {
+    DevGate *g = job->gate;
+    if (!g)
+        return;
+    int threads = job->pool->num_threads;
+    if (!opt_device_jobs && threads > 1) {
+        unsigned long long avg = atomic_load_explicit(&g->op_ns, memory_order_relaxed);
+        avg = avg - avg / 8 + elapsed_ns / (ops + 1) / 8;
+        atomic_store_explicit(&g->op_ns, avg, memory_order_relaxed);
+        if (avg > SLOW_OP_NS)
+            atomic_store_explicit(&g->limit, threads / 2, memory_order_relaxed);
+        else if (avg < SLOW_OP_NS / 2)
+            atomic_store_explicit(&g->limit, threads, memory_order_relaxed);
+    }
+    atomic_fetch_sub(&g->active, 1);
+    if (!atomic_load(&g->waiting))
+        return;
+    SizeJob *ready = NULL;
+    pthread_mutex_lock(&g->lock);
+    while (g->deferred && atomic_load(&g->active) < atomic_load(&g->limit)) {
+        SizeJob *next = g->deferred;
+        g->deferred = next->next;
+        if (!g->deferred)
+            g->deferred_tail = NULL;
+        atomic_fetch_sub(&g->waiting, 1);
+        atomic_fetch_add(&g->active, 1);
+        next->next = ready;
+        ready = next;
+    }
+    pthread_mutex_unlock(&g->lock);
+    while (ready) {
+        SizeJob *next = ready->next;
+        thread_pool_add_task(ready->pool, size_job_task, ready);
+        ready = next;
+    }
+}
+
+/* Walks name under dirfd on the pool, splitting every subdirectory into
+   its own task. Each task adds its files' sizes into *root->total once it
+   is done. dir is the display path of dirfd, dev the device name is
+   expected on, used to pick its DevGate. */
+void spawn_directory_size(ThreadPool *pool, int dirfd, const char *dir, const char *name, dev_t dev,
+                          WalkRoot *root, SizeJob *parent) {
+    size_t len = strlen(name);
+    SizeJob *job = malloc(sizeof(SizeJob) + len + 1);
+    if (!job) {
+        int partial = 0;
+        off_t size = get_directory_size(dirfd, name, root->scope, dir, &partial);
+        if (partial) {
+            atomic_store_explicit(&root->truncated, 1, memory_order_relaxed);
+            if (parent)
+                atomic_store_explicit(&parent->truncated, 1, memory_order_relaxed);
+        }
+        __atomic_fetch_add(root->total, size, __ATOMIC_RELAXED);
+        if (parent)
+            atomic_fetch_add(&parent->subtotal, size);
+        return;
+    }
+    job->pool = pool;
+    job->root = root;
+    job->dev = dev;
+    job->gate = NULL;
+    job->parent = parent;
+    atomic_init(&job->pending, 1);
+    atomic_init(&job->subtotal, 0);
+    atomic_init(&job->truncated, 0);
+    atomic_init(&job->fd_users, 1);
+    job->fd = -1;
+    job->base_fd = dirfd;
+    job->dir = dir;
+    job->via_parent = parent && atomic_load_explicit(&walk_fds_open, memory_order_relaxed) < walk_fd_budget;
+    if (parent)
+        atomic_fetch_add(&parent->pending, 1);
+    if (job->via_parent)
+        atomic_fetch_add(&parent->fd_users, 1);
+    memcpy(job->name, name, len + 1);
+    job->depth = parent ? parent->depth + 1 : 1;
+    job->kept = opt_tree && (parent ? parent->kept : root->scope->tree && !is_dot_or_dotdot(name)) &&
+                (!opt_tree_depth || job->depth <= opt_tree_depth);
+    job->children = job->sibling = NULL;
+    job->files = NULL;
+    if (job->kept && parent) {
+        job->sibling = parent->children;
+        parent->children = job;
+    } else if (job->kept) {
+        job->sibling = atomic_load(root->scope->tree);
+        while (!atomic_compare_exchange_weak(root->scope->tree, &job->sibling, job))
+            ;
+    }
+    atomic_fetch_add(&root->pending, 1);
+    thread_pool_add_task(pool, size_job_task, job);
+}
+
+static void size_job_fd_release(SizeJob *job) {
+    if (atomic_fetch_sub(&job->fd_users, 1) == 1 && job->fd >= 0) {
+        close(job->fd);
+        atomic_fetch_sub_explicit(&walk_fds_open, 1, memory_order_relaxed);
+    }
+}
+
+/* Opens a job that does not hold its parent's fd, from the root job's
+   base_fd. */
+static int size_job_reopen(const SizeJob *job) {
+    size_t depth = 0;
+    const SizeJob *j;
+    for (j = job; j; j = j->parent)
+        depth++;
+    const char **names = malloc(depth * sizeof(char *));
+    if (!names) {
+        errno = ENOMEM;
+        return -1;
+    }
+    const SizeJob *top = job;
+    size_t i = depth;
+    for (j = job; j; j = j->parent) {
+        names[--i] = j->name;
+        top = j;
+    }
+    int fd = open_components(top->base_fd, names, depth);
+    int err = errno;
+    free(names);
+    errno = err;
+    return fd;
+}
+
+/* Opens the job's directory and lets go of the parent's fd. Nothing is
+   opened once the deadline has passed. */
+static void size_job_open(SizeJob *job) {
+    if (!size_job_expired(job)) {
+        if (!job->parent || job->via_parent) {
+            job->fd = openat(job->parent ? job->parent->fd : job->base_fd, job->name,
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            stats_calls(SC_OPEN, 1);
+        } else
+            job->fd = size_job_reopen(job);
+        if (job->fd >= 0)
+            atomic_fetch_add_explicit(&walk_fds_open, 1, memory_order_relaxed);
+        else if (errno != ENOENT)
+            size_job_error(job, "open directory", NULL, errno);
+    }
+    if (job->via_parent)
+        size_job_fd_release(job->parent);
+}
+
+static void size_job_finish(SizeJob *job, off_t sum) {
+    WalkRoot *root = job->root;
+    __atomic_fetch_add(root->total, sum, __ATOMIC_RELAXED);
+    size_job_done(job, sum);
+    walk_root_release(root);
+}
+
+/* A directory argument that lies inside another one. Walks of the outer
+   listing that reach it take its listing's total instead of walking it a
+   second time. A walk only waits on a claim with a longer real path than
+   its own listing's, so waits cannot form a cycle. */
+typedef struct Claim {
+    dev_t dev;
+    ino_t ino;
+    size_t rank;
+    atomic_llong total;
+    atomic_int truncated;
+    pthread_mutex_t lock;
+    int done;
+    SizeJob *waiters;
+} Claim;
+
+/* Sorted by (dev, ino) before any listing starts, read-only afterwards. */
+static Claim **claims = NULL;
+static size_t claim_count = 0;
+
+static int claim_cmp(const void *a, const void *b) {
+    const Claim *x = *(Claim *const *)a, *y = *(Claim *const *)b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+/* Adds one entry's share to the claim of the listing it belongs to. */
+static void claim_add(Claim *c, off_t size, int truncated) {
+    atomic_fetch_add_explicit(&c->total, size, memory_order_relaxed);
+    if (truncated)
+        atomic_store_explicit(&c->truncated, 1, memory_order_relaxed);
+}
+
+/* Returns 1 if job's directory is claimed, with *sum set if the total is
+   already known. Otherwise the job stays open, holding its walk, until
+   claim_complete adds the total. */
+static int claim_join(SizeJob *job, const struct stat *dst, off_t *sum) {
+    Claim key = { .dev = dst->st_dev, .ino = dst->st_ino };
+    Claim *kp = &key;
+    Claim **found = bsearch(&kp, claims, claim_count, sizeof(Claim *), claim_cmp);
+    if (!found || (*found)->rank <= job->root->scope->rank)
+        return 0;
+    Claim *c = *found;
+    pthread_mutex_lock(&c->lock);
+    if (!c->done) {
+        atomic_fetch_add(&job->pending, 1);
+        atomic_fetch_add(&job->root->pending, 1);
+        job->next = c->waiters;
+        c->waiters = job;
+        pthread_mutex_unlock(&c->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (atomic_load_explicit(&c->truncated, memory_order_relaxed)) {
+        atomic_store_explicit(&job->root->truncated, 1, memory_order_relaxed);
+        atomic_store_explicit(&job->truncated, 1, memory_order_relaxed);
+    }
+    *sum = atomic_load_explicit(&c->total, memory_order_relaxed);
+    return 1;
+}
+
+/* TaskGroup callback of a claimed listing: its total is final. */
+static void claim_complete(void *ctx) {
+    Claim *c = (Claim *)ctx;
+    pthread_mutex_lock(&c->lock);
+    c->done = 1;
+    SizeJob *job = c->waiters;
+    c->waiters = NULL;
+    pthread_mutex_unlock(&c->lock);
+    off_t total = atomic_load_explicit(&c->total, memory_order_relaxed);
+    int truncated = atomic_load_explicit(&c->truncated, memory_order_relaxed);
+    while (job) {
+        SizeJob *next = job->next;
+        if (truncated) {
+            atomic_store_explicit(&job->root->truncated, 1, memory_order_relaxed);
+            atomic_store_explicit(&job->truncated, 1, memory_order_relaxed);
+        }
+        size_job_finish(job, total);
+        job = next;
+    }
+}
+
+static void spawn_subdirectory(SizeJob *job, const char *name, NameList *subdirs) {
+    if (subdirs)
+        name_list_add(subdirs, name);
+    spawn_directory_size(job->pool, job->fd, NULL, name, job->dev, job->root, job);
+}
+
+#define DEADLINE_CHECK_EVERY 64
+
+/* Sums the files directly in the job's directory and spawns its
+   subdirectories. *ops counts the entries looked at, for the device
+   latency estimate. */
+static off_t size_job_scan(SizeJob *job, size_t *ops) {
+    off_t sum = 0;
+    int fd = job->fd;
+    if (fd < 0 || size_job_expired(job))
+        return 0;
+    struct stat dst;
+    const DirCacheRecord *rec = NULL;
+    /* without a stat a job keeps its parent's device, which is what the
+       DevGate goes by unless a mount point is crossed below the listing */
+    int want_st = opt_cache || opt_one_fs || claim_count || opt_device_jobs;
+    unsigned mask = STATX_TYPE | STATX_INO | (opt_cache ? STATX_MTIME | STATX_CTIME : 0);
+    int have_st = want_st && stat_at(fd, "", AT_EMPTY_PATH, mask, &dst) == 0;
+    if (want_st)
+        stats_calls(SC_STAT, 1);
+    if (have_st) {
+        if (opt_one_fs && dst.st_dev != job->root->scope->fs_dev)
+            return 0;
+        job->dev = dst.st_dev;
+        if (claim_count && claim_join(job, &dst, &sum))
+            return sum;
+    }
+    int cacheable = opt_cache && have_st;
+    if (cacheable && !opt_top && !opt_tree)
+        rec = dir_cache_lookup(&dst);
+    if (rec && !opt_cache_verify) {
+        const char *name = dir_cache_names(rec);
+        const char *end = name + rec->names_len;
+        while (name < end) {
+            size_t len = strnlen(name, end - name);
+            if (name + len == end)
+                break;
+            spawn_subdirectory(job, name, NULL);
+            name += len + 1;
+        }
+        atomic_fetch_add(&dir_cache.hits, 1);
+        return rec->own_size;
+    }
+    NameList subdirs = {0};
+    /* set when sum is short of the directory's own size, which must then
+       not go into the cache as if it were exact */
+    int cut = 0;
+    DirReader reader;
+    if (dir_reader_init(&reader, fd) == 0) {
+        size_t nstat = 0;
+        IoRing *ring = opt_uring ? io_ring_get() : NULL;
+        StatBatch *batch = ring ? &ring->batch : NULL;
+        if (batch) {
+            batch->count = 0;
+            batch->names_len = 0;
+        }
+        struct linux_dirent64 *entry;
+        unsigned seen = 0;
+        while (1) {
+            if (++seen % DEADLINE_CHECK_EVERY == 0 && size_job_expired(job)) {
+                cut = 1;
+                break;
+            }
+            entry = dir_reader_next(&reader);
+            if (batch && batch->count && (!entry || stat_batch_full(batch, entry->d_name))) {
+                int batched = batch->count >= URING_MIN_BATCH &&
+                              stat_batch_submit(ring, fd, batch, size_stat_mask()) == 0;
+                if (!batched && batch->count >= URING_MIN_BATCH)
+                    atomic_store(&uring_disabled, 1);
+                for (int i = 0; i < batch->count; i++) {
+                    const char *name = batch->names + batch->name_off[i];
+                    const struct statx *stx = &batch->stx[i];
+                    struct stat st;
+                    if (batched) {
+                        if (batch->result[i] < 0) {
+                            if (batch->result[i] != -ENOENT) {
+                                size_job_error(job, "stat", name, -batch->result[i]);
+                                cut = 1;
+                            }
+                            continue;
+                        }
+                    } else {
+                        nstat++;
+                        if (stat_at(fd, name, 0, size_stat_mask(), &st) != 0) {
+                            if (errno != ENOENT) {
+                                size_job_error(job, "stat", name, errno);
+                                cut = 1;
+                            }
+                            continue;
+                        }
+                    }
+                    int is_dir = batched ? S_ISDIR(stx->stx_mode) : S_ISDIR(st.st_mode);
+                    if (batch->types[i] == DT_UNKNOWN && is_dir)
+                        spawn_subdirectory(job, name, cacheable ? &subdirs : NULL);
+                    else {
+                        off_t size = batched ? statx_accounted_size(stx) : stat_accounted_size(&st);
+                        if (opt_top)
+                            top_note_job_file(job, name, size);
+                        if (opt_tree)
+                            tree_note_file(job, name, size);
+                        sum += size;
+                    }
+                }
+                batch->count = 0;
+                batch->names_len = 0;
+            }
+            if (!entry)
+                break;
+            if (is_dot_or_dotdot(entry->d_name) || name_excluded(entry->d_name))
+                continue;
+            (*ops)++;
+            if (entry->d_type == DT_DIR) {
+                spawn_subdirectory(job, entry->d_name, cacheable ? &subdirs : NULL);
+                continue;
+            }
+            if (ring) {
+                stat_batch_add(batch, entry->d_name, entry->d_type);
+                continue;
+            }
+            struct stat st;
+            nstat++;
+            if (stat_at(fd, entry->d_name, 0, size_stat_mask(), &st) != 0) {
+                if (errno != ENOENT) {
+                    size_job_error(job, "stat", entry->d_name, errno);
+                    cut = 1;
+                }
+                continue;
+            }
+            if (entry->d_type == DT_UNKNOWN && S_ISDIR(st.st_mode)) {
+                spawn_subdirectory(job, entry->d_name, cacheable ? &subdirs : NULL);
+                continue;
+            }
+            off_t size = stat_accounted_size(&st);
+            if (opt_top)
+                top_note_job_file(job, entry->d_name, size);
+            if (opt_tree)
+                tree_note_file(job, entry->d_name, size);
+            sum += size;
+        }
+        if (reader.error) {
+            size_job_error(job, "read directory", NULL, reader.error);
+            cut = 1;
+        }
+        dir_reader_release(&reader);
+        stats_calls(SC_STAT, nstat);
+        stats_visit(1, *ops);
+        if (cacheable && !cut) {
+            if (rec && (rec->own_size != sum || rec->nsubdirs != subdirs.count)) {
+                atomic_fetch_add(&dir_cache.stale, 1);
+                char *path = size_job_path(job, NULL);
+                fprintf(stderr, "lsp: stale cache entry for %s\n", path ? path : job->name);
+                free(path);
+            }
+            dir_cache_store(&dst, sum, subdirs.data, subdirs.len, subdirs.count);
+        }
+    } else
+        size_job_error(job, "read directory", NULL, ENOMEM);
+    free(subdirs.data);
+    return sum;
+}
+
+static void size_job_task(void *arg) {
+    SizeJob *job = (SizeJob *)arg;
+    if (!dev_gate_enter(job))
+        return;
+    size_t ops = 0;
+    uint64_t start = monotonic_ns();
+    size_job_open(job);
+    off_t sum = size_job_scan(job, &ops);
+    size_job_fd_release(job);
+    uint64_t elapsed = monotonic_ns() - start;
+    dev_gate_leave(job, elapsed, ops);
+    if (opt_stats) {
+        stats_phase(PH_SIZE, start);
+        atomic_fetch_add_explicit(&job->root->scan_ns, elapsed, memory_order_relaxed);
+    }
+    size_job_finish(job, sum);
+}
+
+#define OUT_BUF_SIZE (256 * 1024)
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len = 0;
+
+void out_flush(void) {
+    size_t off = 0;
+    while (off < out_len) {
+        ssize_t n = write(STDOUT_FILENO, out_buf + off, out_len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    out_len = 0;
+}
+
+void out_write(const char *s, size_t len) {
+    if (len > OUT_BUF_SIZE - out_len) {
+        out_flush();
+        if (len > OUT_BUF_SIZE) {
+            out_len = 0;
+            while (len > 0) {
+                size_t chunk = len > OUT_BUF_SIZE ? OUT_BUF_SIZE : len;
+                memcpy(out_buf, s, chunk);
+                out_len = chunk;
+                out_flush();
+                s += chunk;
+                len -= chunk;
+            }
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, s, len);
+    out_len += len;
+}
+
+void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+static void out_pad(size_t n) {
+    static const char spaces[] = "                                ";
+    while (n > 0) {
+        size_t chunk = n > sizeof(spaces) - 1 ? sizeof(spaces) - 1 : n;
+        out_write(spaces, chunk);
+        n -= chunk;
+    }
+}
+
+static void out_field(const char *s, size_t len, size_t width) {
+    out_write(s, len);
+    if (width > len)
+        out_pad(width - len);
+}
+
+static void out_field_cols(const char *s, size_t len, size_t cols, size_t width) {
+    out_write(s, len);
+    if (width > cols)
+        out_pad(width - cols);
+}
+
+static size_t format_u64(uint64_t v, char *buf) {
+    char tmp[24];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    for (size_t i = 0; i < n; i++)
+        buf[i] = tmp[n - 1 - i];
+    return n;
+}
+
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t cap;
+    _Alignas(16) char data[];
+} ArenaChunk;
+
+/* Bump allocator for everything belonging to one listing, released in one
+   go by arena_free. The lock only matters for the rare allocations made
+   from pool workers, such as symlink targets. */
+typedef struct {
+    ArenaChunk *head;
+    pthread_mutex_t lock;
+} Arena;
+
+void arena_init(Arena *arena) {
+    arena->head = NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    pthread_mutex_lock(&arena->lock);
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->cap - chunk->used < size) {
+        size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(ArenaChunk) + cap);
+        if (!chunk) {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->cap = cap;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    pthread_mutex_unlock(&arena->lock);
+    return p;
+}
+
+char *arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(arena, len);
+    if (p)
+        memcpy(p, s, len);
+    return p;
+}
+
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    pthread_mutex_destroy(&arena->lock);
+}
+
+void entry_path(const FileEntry *fe, char *buf, size_t bufsize) {
+    if (fe->dir)
+        snprintf(buf, bufsize, "%s/%s", fe->dir, fe->name);
+    else
+        snprintf(buf, bufsize, "%s", fe->name);
+}
+
+int utf8_width(const char *s, size_t len) {
+    int w = 0;
+    for (size_t i = 0; i < len; i++)
+        w += ((unsigned char)s[i] & 0xc0) != 0x80;
+    return w;
+}
+
+void out_json_string(const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    out_write("\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80)
+            continue;
+        out_write(run, s - run);
+        run = s + 1;
+        if (c == '"')
+            out_write("\\\"", 2);
+        else if (c == '\\')
+            out_write("\\\\", 2);
+        else if (c == '\n')
+            out_write("\\n", 2);
+        else if (c == '\t')
+            out_write("\\t", 2);
+        else if (c < 0x20) {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            out_write(esc, 6);
+        } else {
+            /* Pass through well-formed UTF-8, map stray bytes to U+00XX so
+               the line stays valid JSON. */
+            int n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : -1;
+            int ok = n > 0;
+            for (int k = 1; ok && k <= n; k++)
+                ok = ((unsigned char)s[k] & 0xc0) == 0x80;
+            if (ok) {
+                out_write(s, n + 1);
+                s += n;
+                run = s + 1;
+            } else {
+                char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+                out_write(esc, 6);
+            }
+        }
+    }
+    out_write(run, s - run);
+    out_write("\"", 1);
+}
+
+void out_json_int(long long v) {
+    char num[24];
+    if (v < 0) {
+        out_write("-", 1);
+        out_write(num, format_u64(-(unsigned long long)v, num));
+    } else
+        out_write(num, format_u64(v, num));
+}
+
+const char *entry_type_name(mode_t mode) {
+    if (S_ISDIR(mode))
+        return "dir";
+    if (S_ISLNK(mode))
+        return "symlink";
+    if (S_ISCHR(mode))
+        return "char";
+    if (S_ISBLK(mode))
+        return "block";
+    if (S_ISFIFO(mode))
+        return "fifo";
+    if (S_ISSOCK(mode))
+        return "socket";
+    return "file";
+}
+
+int opt_stream = 0;
+static int stream_json = 0;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int out_is_tty = 0;
+static struct timespec out_last_flush;
+
+/* Called with out_lock held after each streamed event, so a slow trickle of
+   results still reaches the reader promptly without a write per line. */
+static void stream_maybe_flush(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long ms = (now.tv_sec - out_last_flush.tv_sec) * 1000 + (now.tv_nsec - out_last_flush.tv_nsec) / 1000000;
+    if (ms >= 50 || out_len > OUT_BUF_SIZE / 2) {
+        out_flush();
+        out_last_flush = now;
+    }
+}
+
+/* Writes fe as one JSON object without the newline. event is the streamed
+   event name, or NULL for --format=ndjson records. */
+static void out_json_entry(const FileEntry *fe, const char *event) {
+    char path[PATH_MAX];
+    entry_path(fe, path, sizeof(path));
+    out_write("{", 1);
+    if (event) {
+        out_str("\"event\":\"");
+        out_str(event);
+        out_str("\",");
+    }
+    out_str("\"path\":");
+    out_json_string(path);
+    out_str(",\"name\":");
+    out_json_string(fe->name);
+    out_str(",\"type\":\"");
+    out_str(entry_type_name(fe->mode));
+    out_str("\",\"mode\":");
+    out_json_int(fe->mode & 07777);
+    out_str(",\"uid\":");
+    out_json_int(fe->uid);
+    out_str(",\"gid\":");
+    out_json_int(fe->gid);
+    out_str(",\"size\":");
+    int pending = __atomic_load_n(&fe->size_pending, __ATOMIC_ACQUIRE);
+    if (pending)
+        out_str("null");
+    else
+        out_json_int(__atomic_load_n(&fe->size, __ATOMIC_RELAXED));
+    out_str(",\"mtime\":");
+    out_json_int(fe->mtime);
+    out_str(",\"inode\":");
+    out_json_int(fe->inode);
+    out_str(",\"nlink\":");
+    out_json_int(fe->nlink);
+    if (fe->link_target) {
+        out_str(",\"target\":");
+        out_json_string(fe->link_target);
+    }
+    if (!pending && fe->size_partial)
+        out_str(",\"partial\":true");
+    out_write("}", 1);
+}
+
+void stream_emit_entry(const FileEntry *fe) {
+    pthread_mutex_lock(&out_lock);
+    out_json_entry(fe, "entry");
+    out_write("\n", 1);
+    stream_maybe_flush();
+    pthread_mutex_unlock(&out_lock);
+}
+
+void stream_emit_size(const FileEntry *fe) {
+    char path[PATH_MAX];
+    entry_path(fe, path, sizeof(path));
+    pthread_mutex_lock(&out_lock);
+    out_str("{\"event\":\"size\",\"path\":");
+    out_json_string(path);
+    out_str(",\"size\":");
+    out_json_int(__atomic_load_n(&fe->size, __ATOMIC_RELAXED));
+    if (fe->size_partial)
+        out_str(",\"partial\":true");
+    out_str("}\n");
+    stream_maybe_flush();
+    pthread_mutex_unlock(&out_lock);
+}
+
+void stream_emit_end(const char *dirpath) {
+    pthread_mutex_lock(&out_lock);
+    out_str("{\"event\":\"end\",\"path\":");
+    out_json_string(dirpath);
+    out_str("}\n");
+    stream_maybe_flush();
+    pthread_mutex_unlock(&out_lock);
+}
+
+/* Watch daemon (--daemon=SOCKET DIR). One full walk builds a tree of
+   directory nodes holding the size of their own files and of their whole
+   subtree. inotify events then only mark directories dirty; each dirty
+   directory is re-read on its own and the change in its total is added to
+   every ancestor, so keeping sizes current costs O(changes), not O(tree).
+   A directory is re-read at most once per WATCH_SETTLE_MS however many
+   events it gets, so a file being written does not rescan it per write;
+   a query flushes pending re-reads first, so answers are never stale.
+   Clients (--query=SOCKET) write one absolute path per line and read back
+   the subtree size in bytes, or "?" for a path outside the tree. */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_CLIENTS 64
+#define WATCH_LINE (PATH_MAX + 2)
+#define WATCH_SETTLE_MS 100
+
+typedef struct WatchNode {
+    char *name;
+    struct WatchNode *parent;
+    struct WatchNode *children;
+    struct WatchNode *sibling;
+    int wd;
+    unsigned char dirty;
+    off_t own;
+    off_t total;
+} WatchNode;
+
+typedef struct Watcher {
+    int fd;
+    WatchNode *root;
+    const char *root_path;
+    WatchNode **by_wd;
+    size_t wd_cap;
+    int *dirty;
+    size_t dirty_count;
+    size_t dirty_cap;
+    uint64_t dirty_since;
+    size_t nodes;
+    int watch_failed;
+} Watcher;
+
+typedef struct WatchClient {
+    int fd;
+    size_t len;
+    char buf[WATCH_LINE];
+} WatchClient;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_on_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+/* Absolute path of n, built from its ancestors' names. The caller frees
+   it. */
+static char *watch_node_path(Watcher *w, WatchNode *n) {
+    if (!n->parent)
+        return strdup(w->root_path);
+    size_t base = strcmp(w->root_path, "/") ? strlen(w->root_path) : 0;
+    size_t len = base;
+    for (WatchNode *p = n; p->parent; p = p->parent)
+        len += strlen(p->name) + 1;
+    char *path = malloc(len + 1);
+    if (!path)
+        return NULL;
+    memcpy(path, w->root_path, base);
+    path[len] = '\0';
+    for (WatchNode *p = n; p->parent; p = p->parent) {
+        size_t name_len = strlen(p->name);
+        len -= name_len;
+        memcpy(path + len, p->name, name_len);
+        path[--len] = '/';
+    }
+    return path;
+}
+
+static void watch_add(Watcher *w, WatchNode *node, const char *path) {
+    node->wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+    if (node->wd < 0) {
+        if (!w->watch_failed)
+            fprintf(stderr, "lsp: cannot watch %s: %s, its size will not be updated\n", path, strerror(errno));
+        w->watch_failed = 1;
+        return;
+    }
+    if ((size_t)node->wd >= w->wd_cap) {
+        size_t cap = w->wd_cap ? w->wd_cap : 1024;
+        while (cap <= (size_t)node->wd)
+            cap *= 2;
+        WatchNode **tmp = realloc(w->by_wd, cap * sizeof(WatchNode *));
+        if (!tmp) {
+            inotify_rm_watch(w->fd, node->wd);
+            node->wd = -1;
+            return;
+        }
+        memset(tmp + w->wd_cap, 0, (cap - w->wd_cap) * sizeof(WatchNode *));
+        w->by_wd = tmp;
+        w->wd_cap = cap;
+    }
+    w->by_wd[node->wd] = node;
+}
+
+/* A directory renamed within the tree can be re-added under its new parent
+   before the old node is dropped; the watch then already belongs to the
+   new node and must be left alone. Children are spliced into the list
+   being freed instead of recursing. */
+static void watch_drop(Watcher *w, WatchNode *node) {
+    node->sibling = NULL;
+    while (node) {
+        WatchNode *next = node->sibling;
+        if (node->children) {
+            WatchNode *last = node->children;
+            while (last->sibling)
+                last = last->sibling;
+            last->sibling = next;
+            next = node->children;
+        }
+        if (node->wd >= 0 && w->by_wd[node->wd] == node) {
+            inotify_rm_watch(w->fd, node->wd);
+            w->by_wd[node->wd] = NULL;
+        }
+        w->nodes--;
+        free(node->name);
+        free(node);
+        node = next;
+    }
+}
+
+static int watch_child_cmp(const void *a, const void *b) {
+    return strcmp((*(WatchNode *const *)a)->name, (*(WatchNode *const *)b)->name);
+}
+
+static int watch_name_cmp(const void *key, const void *elem) {
+    return strcmp((const char *)key, (*(WatchNode *const *)elem)->name);
+}
+
+typedef struct {
+    WatchNode **items;
+    size_t len;
+    size_t cap;
+} WatchList;
+
+static int watch_list_push(WatchList *l, WatchNode *node) {
+    if (grow(&l->items, &l->cap, l->len + 1, sizeof(WatchNode *)) < 0)
+        return -1;
+    l->items[l->len++] = node;
+    return 0;
+}
+
+/* Re-reads one directory: recounts its own files, drops subdirectories
+   that are gone and adds new ones. New subdirectories, and with deep set
+   existing ones as well, are queued on todo to be read in turn. */
+static void watch_scan(Watcher *w, WatchNode *node, int deep, WatchList *todo) {
+    char *path = watch_node_path(w, node);
+    if (!path)
+        return;
+    off_t own = 0;
+    NameList subdirs = {0};
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat dst;
+    if (fd >= 0 && opt_one_fs && stat_at(fd, "", AT_EMPTY_PATH, STATX_TYPE, &dst) == 0 && dst.st_dev != walk_dev) {
+        close(fd);
+        fd = -1;
+    }
+    DirReader reader;
+    if (fd >= 0 && dir_reader_init(&reader, fd) == 0) {
+        struct linux_dirent64 *entry;
+        while ((entry = dir_reader_next(&reader)) != NULL) {
+            if (is_dot_or_dotdot(entry->d_name) || name_excluded(entry->d_name))
+                continue;
+            if (entry->d_type == DT_DIR) {
+                name_list_add(&subdirs, entry->d_name);
+                continue;
+            }
+            struct stat st;
+            if (stat_at(fd, entry->d_name, 0, size_stat_mask(), &st) != 0)
+                continue;
+            if (entry->d_type == DT_UNKNOWN && S_ISDIR(st.st_mode))
+                name_list_add(&subdirs, entry->d_name);
+            else
+                own += stat_accounted_size(&st);
+        }
+        dir_reader_release(&reader);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    size_t nchildren = 0;
+    for (WatchNode *c = node->children; c; c = c->sibling)
+        nchildren++;
+    WatchNode **sorted = malloc((nchildren ? nchildren : 1) * sizeof(WatchNode *));
+    unsigned char *keep = calloc(nchildren ? nchildren : 1, 1);
+    char *child_path = NULL;
+    size_t child_cap = 0, base = strlen(path);
+    if (base == 1 && path[0] == '/')
+        base = 0;
+    if (!sorted || !keep) {
+        free(sorted);
+        free(keep);
+        free(subdirs.data);
+        free(path);
+        return;
+    }
+    size_t k = 0;
+    for (WatchNode *c = node->children; c; c = c->sibling)
+        sorted[k++] = c;
+    qsort(sorted, nchildren, sizeof(WatchNode *), watch_child_cmp);
+
+    WatchNode *children = NULL;
+    const char *name = subdirs.data;
+    for (size_t i = 0; i < subdirs.count; i++, name += strlen(name) + 1) {
+        WatchNode **found = bsearch(name, sorted, nchildren, sizeof(WatchNode *), watch_name_cmp);
+        WatchNode *c;
+        if (found) {
+            c = *found;
+            keep[found - sorted] = 1;
+            if (deep)
+                watch_list_push(todo, c);
+        } else {
+            size_t len = base + strlen(name) + 2;
+            c = calloc(1, sizeof(WatchNode));
+            if (!c || !(c->name = strdup(name)) || grow(&child_path, &child_cap, len, 1) < 0) {
+                if (c)
+                    free(c->name);
+                free(c);
+                continue;
+            }
+            memcpy(child_path, path, base);
+            child_path[base] = '/';
+            strcpy(child_path + base + 1, name);
+            c->parent = node;
+            c->wd = -1;
+            w->nodes++;
+            watch_add(w, c, child_path);
+            watch_list_push(todo, c);
+        }
+        c->sibling = children;
+        children = c;
+    }
+    for (size_t i = 0; i < nchildren; i++)
+        if (!keep[i])
+            watch_drop(w, sorted[i]);
+    node->children = children;
+    node->own = own;
+    free(sorted);
+    free(keep);
+    free(child_path);
+    free(subdirs.data);
+    free(path);
+}
+
+/* Brings node's subtree up to date from an explicit worklist, then sums
+   the totals of the directories read, children before parents. Returns
+   the change in node->total. */
+static off_t watch_sync(Watcher *w, WatchNode *node, int deep) {
+    off_t old_total = node->total;
+    WatchList todo = {0}, done = {0};
+    watch_list_push(&todo, node);
+    while (todo.len > 0) {
+        WatchNode *n = todo.items[--todo.len];
+        if (watch_list_push(&done, n) < 0)
+            break;
+        watch_scan(w, n, deep, &todo);
+    }
+    while (done.len > 0) {
+        WatchNode *n = done.items[--done.len];
+        n->total = n->own;
+        for (WatchNode *c = n->children; c; c = c->sibling)
+            n->total += c->total;
+    }
+    free(todo.items);
+    free(done.items);
+    return node->total - old_total;
+}
+
+static void watch_update(Watcher *w, WatchNode *node, int deep) {
+    off_t delta = watch_sync(w, node, deep);
+    for (WatchNode *p = node->parent; p; p = p->parent)
+        p->total += delta;
+}
+
+static void watch_mark(Watcher *w, int wd) {
+    if (wd < 0 || (size_t)wd >= w->wd_cap || !w->by_wd[wd] || w->by_wd[wd]->dirty)
+        return;
+    if (w->dirty_count == w->dirty_cap) {
+        size_t cap = w->dirty_cap ? w->dirty_cap * 2 : 64;
+        int *tmp = realloc(w->dirty, cap * sizeof(int));
+        if (!tmp)
+            return;
+        w->dirty = tmp;
+        w->dirty_cap = cap;
+    }
+    if (!w->dirty_count)
+        w->dirty_since = monotonic_ns();
+    w->by_wd[wd]->dirty = 1;
+    w->dirty[w->dirty_count++] = wd;
+}
+
+/* Drains the inotify queue, marking directories dirty. Returns -1 once the
+   watched root is gone. */
+static int watch_events(Watcher *w) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int overflow = 0, gone = 0;
+    while (1) {
+        ssize_t n = read(w->fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW)
+                overflow = 1;
+            else if ((ev->mask & IN_DELETE_SELF) && ev->wd == w->root->wd)
+                gone = 1;
+            else if (!(ev->mask & IN_IGNORED))
+                watch_mark(w, ev->wd);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (gone)
+        return -1;
+    if (overflow) {
+        fprintf(stderr, "lsp: inotify queue overflowed, rescanning %s\n", w->root_path);
+        watch_update(w, w->root, 1);
+    }
+    return 0;
+}
+
+/* Re-reads every directory marked dirty since the last flush, once. */
+static void watch_flush(Watcher *w) {
+    for (size_t i = 0; i < w->dirty_count; i++) {
+        int wd = w->dirty[i];
+        WatchNode *node = (size_t)wd < w->wd_cap ? w->by_wd[wd] : NULL;
+        if (node && node->dirty) {
+            node->dirty = 0;
+            watch_update(w, node, 0);
+        }
+    }
+    w->dirty_count = 0;
+}
+
+static WatchNode *watch_lookup(Watcher *w, const char *path) {
+    size_t root_len = strlen(w->root_path);
+    if (strncmp(path, w->root_path, root_len) != 0)
+        return NULL;
+    path += root_len;
+    if (root_len > 1 && *path && *path != '/')
+        return NULL;
+    WatchNode *node = w->root;
+    while (node && *path) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+        size_t len = strcspn(path, "/");
+        WatchNode *c = node->children;
+        while (c && (strncmp(c->name, path, len) != 0 || c->name[len]))
+            c = c->sibling;
+        node = c;
+        path += len;
+    }
+    return node;
+}
+
+static void watch_write(int fd, const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+/* Answers every complete line buffered for c. Returns -1 when the client
+   has hung up. */
+static int watch_serve(Watcher *w, WatchClient *c) {
+    ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (n <= 0)
+        return n < 0 && errno == EINTR ? 0 : -1;
+    c->len += n;
+    char *line = c->buf, *nl;
+    while ((nl = memchr(line, '\n', c->buf + c->len - line)) != NULL) {
+        *nl = '\0';
+        WatchNode *node = watch_lookup(w, line);
+        char reply[24];
+        size_t len = node ? format_u64(node->total, reply) : (reply[0] = '?', 1);
+        reply[len++] = '\n';
+        watch_write(c->fd, reply, len);
+        line = nl + 1;
+    }
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == sizeof(c->buf))
+        return -1;
+    return 0;
+}
+
+int watch_daemon(const char *socket_path, const char *dir) {
+    char root_path[PATH_MAX];
+    if (!realpath(dir, root_path)) {
+        fprintf(stderr, "lsp: %s: %s\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "lsp: socket path too long: %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socket_path);
+    Watcher w = {0};
+    w.root_path = root_path;
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (w.fd < 0 || lfd < 0) {
+        fprintf(stderr, "lsp: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    /* only a stale socket is replaced, never a file or a live daemon */
+    struct stat sock_st;
+    if (lstat(socket_path, &sock_st) == 0) {
+        if (!S_ISSOCK(sock_st.st_mode)) {
+            fprintf(stderr, "lsp: %s exists and is not a socket\n", socket_path);
+            return EXIT_FAILURE;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live) {
+            fprintf(stderr, "lsp: a daemon is already listening on %s\n", socket_path);
+            return EXIT_FAILURE;
+        }
+        unlink(socket_path);
+    }
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0) {
+        fprintf(stderr, "lsp: cannot listen on %s: %s\n", socket_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct sigaction sa = {0};
+    sa.sa_handler = watch_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct stat st;
+    if (opt_one_fs && stat(root_path, &st) == 0)
+        walk_dev = st.st_dev;
+    w.root = calloc(1, sizeof(WatchNode));
+    if (!w.root)
+        return EXIT_FAILURE;
+    w.root->wd = -1;
+    w.nodes = 1;
+    uint64_t start = monotonic_ns();
+    watch_add(&w, w.root, root_path);
+    watch_sync(&w, w.root, 0);
+    char size_str[24];
+    human_readable_size(w.root->total, size_str, sizeof(size_str));
+    fprintf(stderr, "lsp: watching %s: %zu directories, %s, walked in %.0f ms\n",
+            root_path, w.nodes, size_str, (monotonic_ns() - start) / 1e6);
+
+    WatchClient *clients[WATCH_CLIENTS] = {0};
+    int status = EXIT_SUCCESS;
+    while (!watch_stop) {
+        struct pollfd pfd[WATCH_CLIENTS + 2];
+        int map[WATCH_CLIENTS];
+        nfds_t n = 0;
+        pfd[n++] = (struct pollfd){ .fd = w.fd, .events = POLLIN };
+        pfd[n++] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+        for (int i = 0; i < WATCH_CLIENTS; i++) {
+            if (clients[i]) {
+                map[n - 2] = i;
+                pfd[n++] = (struct pollfd){ .fd = clients[i]->fd, .events = POLLIN };
+            }
+        }
+        int timeout = -1;
+        if (w.dirty_count) {
+            uint64_t waited = (monotonic_ns() - w.dirty_since) / 1000000;
+            timeout = waited >= WATCH_SETTLE_MS ? 0 : (int)(WATCH_SETTLE_MS - waited);
+        }
+        if (poll(pfd, n, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            status = EXIT_FAILURE;
+            break;
+        }
+        if ((pfd[0].revents & POLLIN) && watch_events(&w) < 0) {
+            fprintf(stderr, "lsp: %s was removed\n", root_path);
+            status = EXIT_FAILURE;
+            break;
+        }
+        int asked = 0;
+        for (nfds_t i = 2; i < n; i++)
+            asked |= pfd[i].revents != 0;
+        if (w.dirty_count && (asked || monotonic_ns() - w.dirty_since >= WATCH_SETTLE_MS * 1000000ULL))
+            watch_flush(&w);
+        for (nfds_t i = 2; i < n; i++) {
+            WatchClient *c = clients[map[i - 2]];
+            if (pfd[i].revents && watch_serve(&w, c) < 0) {
+                close(c->fd);
+                free(c);
+                clients[map[i - 2]] = NULL;
+            }
+        }
+        if (pfd[1].revents & POLLIN) {
+            int cfd;
+            while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                int slot = 0;
+                while (slot < WATCH_CLIENTS && clients[slot])
+                    slot++;
+                WatchClient *c = slot < WATCH_CLIENTS ? malloc(sizeof(WatchClient)) : NULL;
+                if (!c) {
+                    close(cfd);
+                    continue;
+                }
+                c->fd = cfd;
+                c->len = 0;
+                clients[slot] = c;
+            }
+        }
+    }
+    for (int i = 0; i < WATCH_CLIENTS; i++) {
+        if (clients[i]) {
+            close(clients[i]->fd);
+            free(clients[i]);
+        }
+    }
+    close(lfd);
+    unlink(socket_path);
+    watch_drop(&w, w.root);
+    close(w.fd);
+    free(w.by_wd);
+    free(w.dirty);
+    return status;
+}
+
+const char *opt_query = NULL;
+static atomic_int query_failed;
+
+/* Each thread has its own connection, -2 once it was refused or dropped,
+   so workers' lookups run side by side instead of queueing on one. */
+static __thread int query_fd = -1;
+static __thread char query_dir[PATH_MAX];
+static __thread char query_real[PATH_MAX];
+
+/* Asks the --query daemon for the size of directory fe. Returns -1 when
+   there is no daemon or it does not know the path, so the caller walks. */
+off_t watch_query_size(const FileEntry *fe) {
+    if (!opt_query)
+        return -1;
+    off_t size = -1;
+    if (query_fd == -1) {
+        query_fd = -2;
+        if (!atomic_load_explicit(&query_failed, memory_order_relaxed)) {
+            struct sockaddr_un addr = { .sun_family = AF_UNIX };
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opt_query);
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+                query_fd = fd;
+            else {
+                if (fd >= 0)
+                    close(fd);
+                if (!atomic_exchange(&query_failed, 1))
+                    fprintf(stderr, "lsp: cannot reach daemon at %s, computing sizes directly\n", opt_query);
+            }
+        }
+    }
+    char line[PATH_MAX + 2];
+    int len = -1;
+    if (query_fd >= 0) {
+        const char *dir = fe->dir ? fe->dir : ".";
+        if (strcmp(dir, query_dir) != 0) {
+            snprintf(query_dir, sizeof(query_dir), "%s", dir);
+            if (!realpath(dir, query_real))
+                query_real[0] = '\0';
+        }
+        if (query_real[0])
+            len = snprintf(line, sizeof(line), "%s/%s\n", strcmp(query_real, "/") ? query_real : "", fe->name);
+    }
+    if (len > 0 && len < (int)sizeof(line)) {
+        watch_write(query_fd, line, len);
+        /* one request in flight, so the reply is all there is to read */
+        size_t got = 0;
+        while (got < sizeof(line) - 1 && (!got || line[got - 1] != '\n')) {
+            ssize_t n = read(query_fd, line + got, sizeof(line) - 1 - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        line[got] = '\0';
+        if (got > 0 && line[0] != '?')
+            size = strtoll(line, NULL, 10);
+        else if (got == 0) {
+            /* the daemon hung up, or had no room for this connection */
+            close(query_fd);
+            query_fd = -2;
+        }
+    }
+    return size;
+}
+
+/* One directory being listed. With several arguments, listings are started
+   on the shared pool ahead of time and finished in argument order, so the
+   walks of later ones overlap with the output of earlier ones. A listing of
+   a directory that was already given points at the first one with same. */
+typedef struct DirListing {
+    char *dirpath;
+    int dirfd;
+    int show_hidden;
+    int print_header;
+    int failed;
+    int keep;
+    dev_t dev;
+    ino_t ino;
+    ThreadPool *pool;
+    Arena arena;
+    NameList names;
+    FileEntry **entries;
+    size_t count;
+    struct DirListing *same;
+    TaskGroup group;
+    WalkScope scope;
+    _Atomic(SizeJob *) tree;
+} DirListing;
+
+typedef struct {
+    DirListing *dir;
+    const char *dname;
+    FileEntry *entry;
+    FileEntry **result;
+} ThreadTaskArg;
+
+static void entry_size_done(WalkRoot *root) {
+    FileEntry *fe = (FileEntry *)root->ctx;
+    fe->size_partial = atomic_load_explicit(&root->truncated, memory_order_relaxed);
+    if (root->scope->claim && !is_dot_or_dotdot(fe->name))
+        claim_add(root->scope->claim, fe->size, fe->size_partial);
+    if (opt_stats) {
+        char path[PATH_MAX];
+        entry_path(fe, path, sizeof(path));
+        stats_subtree(path, atomic_load_explicit(&root->scan_ns, memory_order_relaxed));
+    }
+    __atomic_store_n(&fe->size_pending, 0, __ATOMIC_RELEASE);
+    if (stream_json)
+        stream_emit_size(fe);
+}
+
+/* name is relative to dir->dirfd. The names given on the command line are
+   collected into a listing of their own, with AT_FDCWD and no dirpath. */
+void populate_file_entry(FileEntry *fe, DirListing *dir, const char *name, const struct stat *st) {
+    WalkRoot *root = NULL;
+    int dirfd = dir->dirfd;
+    Claim *claim = is_dot_or_dotdot(name) ? NULL : dir->scope.claim;
+    fe->name = name;
+    fe->dir = dir->dirpath;
+    fe->size_pending = 0;
+    fe->size_partial = 0;
+    fe->mode = st->st_mode;
+    fe->uid = st->st_uid;
+    fe->gid = st->st_gid;
+    fe->mtime = st->st_mtime;
+    fe->inode = st->st_ino;
+    fe->nlink = st->st_nlink;
+    fe->is_dir = S_ISDIR(st->st_mode);
+    fe->target_type = 0;
+    int renders = opt_format == FORMAT_TEXT && !stream_json;
+    if (renders)
+        id_names_warm(fe->uid, fe->gid);
+    if (S_ISLNK(st->st_mode)) {
+        fe->is_symlink = 1;
+        struct stat target_st;
+        if (renders || claim) {
+            stats_calls(SC_STAT, 1);
+            if (stat_at(dirfd, name, 0, claim ? size_stat_mask() : STATX_TYPE, &target_st) == 0) {
+                fe->target_type = (target_st.st_mode & S_IFMT) >> 12;
+                if (claim)
+                    claim_add(claim, stat_accounted_size(&target_st), 0);
+            }
+        }
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(dirfd, name, target, sizeof(target) - 1);
+        stats_calls(SC_READLINK, 1);
+        if (len != -1) {
+            target[len] = '\0';
+            fe->link_target = arena_strdup(&dir->arena, target);
+        } else
+            fe->link_target = arena_strdup(&dir->arena, "unreadable");
+        fe->size = opt_allocated ? (off_t)st->st_blocks * 512 : st->st_size;
+    } else {
+        fe->is_symlink = 0;
+        fe->link_target = NULL;
+        off_t known = fe->is_dir && !opt_tree ? watch_query_size(fe) : -1;
+        if (known < 0 && fe->is_dir && dir->pool)
+            root = arena_alloc(&dir->arena, sizeof(WalkRoot));
+        if (known >= 0)
+            fe->size = known;
+        else if (root) {
+            fe->size = 0;
+            fe->size_pending = 1;
+            walk_root_init(root, &dir->scope, &fe->size, entry_size_done, fe);
+            spawn_directory_size(dir->pool, dirfd, dir->dirpath, name, st->st_dev, root, NULL);
+        } else if (fe->is_dir) {
+            int partial = 0;
+            fe->size = get_directory_size(dirfd, name, &dir->scope, dir->dirpath, &partial);
+            fe->size_partial = partial;
+        } else
+            fe->size = opt_allocated ? (off_t)st->st_blocks * 512 : st->st_size;
+        if (claim && !root)
+            claim_add(claim, fe->is_dir ? fe->size : stat_accounted_size(st), fe->size_partial);
+        if (opt_top && fe->dir && !fe->is_dir)
+            top_note_file(fe->dir, fe->name, fe->size);
+    }
+    if (stream_json)
+        stream_emit_entry(fe);
+    if (root)
+        walk_root_release(root);
+}
+
+void process_file_collect(const char *filepath, DirListing *args, FileEntry ***files, size_t *count, size_t *cap) {
+    struct stat st;
+    if (stat_at(AT_FDCWD, filepath, AT_SYMLINK_NOFOLLOW, entry_stat_mask(), &st) < 0)
+        return;
+    if (*count >= *cap) {
+        FileEntry **tmp = realloc(*files, *cap * 2 * sizeof(FileEntry *));
+        if (!tmp)
+            return;
+        *files = tmp;
+        *cap *= 2;
+    }
+    FileEntry *fe = arena_alloc(&args->arena, sizeof(FileEntry));
+    const char *name = arena_strdup(&args->arena, filepath);
+    if (!fe || !name)
+        return;
+    populate_file_entry(fe, args, name, &st);
+    (*files)[(*count)++] = fe;
+}
+
+void process_entry_task(void *arg) {
+    ThreadTaskArg *tta = (ThreadTaskArg *)arg;
+    struct stat st;
+    uint64_t start = stats_clock();
+    stats_calls(SC_STAT, 1);
+    if (stat_at(tta->dir->dirfd, tta->dname, AT_SYMLINK_NOFOLLOW, entry_stat_mask(), &st) < 0)
+        *(tta->result) = NULL;
+    else {
+        populate_file_entry(tta->entry, tta->dir, tta->dname, &st);
+        __atomic_store_n(tta->result, tta->entry, __ATOMIC_RELEASE);
+    }
+    stats_phase(PH_STAT, start);
+    task_group_release(&tta->dir->group);
+}
+
+const char *size_color(off_t size) {
+    if (size < 1024LL)
+        return "";
+    if (size < 1024LL * 1024)
+        return COLOR_GREEN;
+    if (size < 1024LL * 1024 * 1024)
+        return COLOR_ORANGE;
+    if (size < 1024LL * 1024 * 1024 * 1024)
+        return COLOR_RED;
+    return "";
+}
+
+const char *date_color(time_t mtime, time_t now) {
+    double seconds = difftime(now, mtime);
+    if (seconds >= 31536000)
+        return COLOR_DARK_GREY;
+    if (seconds >= 2592000)
+        return COLOR_GREY;
+    return "";
+}
+
+const char *name_color(const FileEntry *fe) {
+    if (fe->is_symlink)
+        return COLOR_SYMLINK;
+    if (fe->is_dir)
+        return COLOR_DIR;
+    if ((fe->mode & S_IXUSR) || (fe->mode & S_IXGRP) || (fe->mode & S_IXOTH))
+        return COLOR_GREEN;
+    return COLOR_FILE;
+}
+
+typedef struct {
+    uid_t uid;
+    gid_t gid;
+    int used;
+    unsigned char len;
+    char str[64];
+} OwnerSlot;
+
+/* "user:group" strings of one listing, formatted once per distinct
+   (uid, gid) pair. */
+typedef struct {
+    OwnerSlot *slots;
+    size_t cap;
+    size_t count;
+} OwnerTable;
+
+static size_t owner_slot(const OwnerSlot *slots, size_t cap, uid_t uid, gid_t gid) {
+    size_t h = ((size_t)uid * 0x9e3779b1u) ^ ((size_t)gid * 0x85ebca6bu);
+    size_t j = h & (cap - 1);
+    while (slots[j].used && (slots[j].uid != uid || slots[j].gid != gid))
+        j = (j + 1) & (cap - 1);
+    return j;
+}
+
+static const OwnerSlot *owner_lookup(OwnerTable *t, uid_t uid, gid_t gid) {
+    static OwnerSlot fallback = { 0, 0, 1, 15, "unknown:unknown" };
+    if ((t->count + 1) * 2 > t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        OwnerSlot *slots = calloc(cap, sizeof(OwnerSlot));
+        if (!slots)
+            return &fallback;
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].used)
+                slots[owner_slot(slots, cap, t->slots[i].uid, t->slots[i].gid)] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
+    }
+    OwnerSlot *s = &t->slots[owner_slot(t->slots, t->cap, uid, gid)];
+    if (!s->used) {
+        s->used = 1;
+        s->uid = uid;
+        s->gid = gid;
+        int len = snprintf(s->str, sizeof(s->str), "%s:%s", get_username_cached(uid), get_groupname_cached(gid));
+        s->len = len < (int)sizeof(s->str) ? len : (int)sizeof(s->str) - 1;
+        t->count++;
+    }
+    return s;
+}
+
+typedef struct {
+    const OwnerSlot *owner;
+    char size_str[24];
+    char time_str[16];
+    unsigned char size_len;
+    unsigned char size_width;
+    unsigned char time_len;
+} EntryColumns;
+
+static void out_csv_string(const char *s) {
+    if (!s[strcspn(s, ",\"\r\n")]) {
+        out_str(s);
+        return;
+    }
+    out_write("\"", 1);
+    const char *q;
+    while ((q = strchr(s, '"')) != NULL) {
+        out_write(s, q - s + 1);
+        out_write("\"", 1);
+        s = q + 1;
+    }
+    out_str(s);
+    out_write("\"", 1);
+}
+
+static void out_csv_int(long long v) {
+    out_write(",", 1);
+    out_json_int(v);
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+#define RECORD_MAGIC "LSPREC01"
+#define RECORD_FIXED 56
+#define RECORD_HAS_TARGET 1
+#define RECORD_PARTIAL 2
+
+/* Binary record, all integers little-endian:
+     u32 record length including this field, u32 st_mode, u32 uid, u32 gid,
+     i64 size, i64 mtime, u64 inode, u64 nlink,
+     u16 path length, u16 target length, u8 flags, 3 bytes zero,
+   then the path and link target bytes, unterminated. The stream starts
+   with the 8 byte magic "LSPREC01". */
+static void out_binary_record(const FileEntry *fe) {
+    char path[PATH_MAX];
+    entry_path(fe, path, sizeof(path));
+    size_t path_len = strlen(path);
+    size_t target_len = fe->link_target ? strlen(fe->link_target) : 0;
+    if (path_len > 0xffff)
+        path_len = 0xffff;
+    if (target_len > 0xffff)
+        target_len = 0xffff;
+    unsigned char rec[RECORD_FIXED] = {0};
+    put_le(rec, RECORD_FIXED + path_len + target_len, 4);
+    put_le(rec + 4, fe->mode, 4);
+    put_le(rec + 8, fe->uid, 4);
+    put_le(rec + 12, fe->gid, 4);
+    put_le(rec + 16, (uint64_t)fe->size, 8);
+    put_le(rec + 24, (uint64_t)fe->mtime, 8);
+    put_le(rec + 32, fe->inode, 8);
+    put_le(rec + 40, fe->nlink, 8);
+    put_le(rec + 48, path_len, 2);
+    put_le(rec + 50, target_len, 2);
+    rec[52] = (fe->link_target ? RECORD_HAS_TARGET : 0) | (fe->size_partial ? RECORD_PARTIAL : 0);
+    out_write((const char *)rec, RECORD_FIXED);
+    out_write(path, path_len);
+    if (target_len)
+        out_write(fe->link_target, target_len);
+}
+
+static int records_started = 0;
+
+/* --format output: exact sizes and raw fields, one record per entry, no
+   per-listing headers. */
+void print_records(FileEntry **entries, size_t count) {
+    if (!records_started) {
+        if (opt_format == FORMAT_CSV)
+            out_str("path,name,type,mode,uid,gid,size,mtime,inode,nlink,target,partial\n");
+        else if (opt_format == FORMAT_BINARY)
+            out_write(RECORD_MAGIC, 8);
+        records_started = 1;
+    }
+    char path[PATH_MAX];
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *fe = entries[i];
+        if (opt_format == FORMAT_NDJSON) {
+            out_json_entry(fe, NULL);
+            out_write("\n", 1);
+        } else if (opt_format == FORMAT_CSV) {
+            entry_path(fe, path, sizeof(path));
+            out_csv_string(path);
+            out_write(",", 1);
+            out_csv_string(fe->name);
+            out_write(",", 1);
+            out_str(entry_type_name(fe->mode));
+            out_csv_int(fe->mode & 07777);
+            out_csv_int(fe->uid);
+            out_csv_int(fe->gid);
+            out_csv_int(fe->size);
+            out_csv_int(fe->mtime);
+            out_csv_int(fe->inode);
+            out_csv_int(fe->nlink);
+            out_write(",", 1);
+            if (fe->link_target)
+                out_csv_string(fe->link_target);
+            out_str(fe->size_partial ? ",1\n" : ",0\n");
+        } else
+            out_binary_record(fe);
+    }
+}
+
+static int top_item_cmp(const void *a, const void *b) {
+    const TopItem *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+static void top_print(const char *title, const char *dirpath, TopItem *items, size_t count) {
+    char size_str[24];
+    size_t width = 0;
+    qsort(items, count, sizeof(TopItem), top_item_cmp);
+    if (count > opt_top)
+        count = opt_top;
+    for (size_t i = 0; i < count; i++) {
+        human_readable_size(items[i].size, size_str, sizeof(size_str));
+        if (strlen(size_str) > width)
+            width = strlen(size_str);
+    }
+    out_str(title);
+    out_str(dirpath);
+    out_write(":\n", 2);
+    for (size_t i = 0; i < count; i++) {
+        human_readable_size(items[i].size, size_str, sizeof(size_str));
+        out_write("  ", 2);
+        out_str(size_color(items[i].size));
+        out_str(size_str);
+        out_str(COLOR_RESET);
+        out_pad(width - strlen(size_str) + 2);
+        out_str(items[i].path);
+        out_write("\n", 1);
+    }
+}
+
+/* Merges the per-thread --top heaps gathered while listing dirpath, prints
+   the largest directories and files, and empties the heaps for the next
+   listing. */
+void top_report(const char *dirpath) {
+    size_t total = 0;
+    for (TopHeaps *t = all_top; t; t = t->next)
+        total += t->files.count + t->dirs.count;
+    TopItem *files = malloc((total ? total : 1) * sizeof(TopItem));
+    TopItem *dirs = malloc((total ? total : 1) * sizeof(TopItem));
+    size_t nfiles = 0, ndirs = 0;
+    for (TopHeaps *t = all_top; t; t = t->next) {
+        for (size_t i = 0; i < t->files.count; i++) {
+            if (files)
+                files[nfiles++] = t->files.items[i];
+            else
+                free(t->files.items[i].path);
+        }
+        for (size_t i = 0; i < t->dirs.count; i++) {
+            if (dirs)
+                dirs[ndirs++] = t->dirs.items[i];
+            else
+                free(t->dirs.items[i].path);
+        }
+        t->files.count = t->dirs.count = 0;
+    }
+    if (opt_format == FORMAT_TEXT && !stream_json) {
+        out_write("\n", 1);
+        top_print("largest directories in ", dirpath, dirs, ndirs);
+        top_print("largest files in ", dirpath, files, nfiles);
+    }
+    for (size_t i = 0; i < nfiles; i++)
+        free(files[i].path);
+    for (size_t i = 0; i < ndirs; i++)
+        free(dirs[i].path);
+    free(files);
+    free(dirs);
+}
+
+static void top_free(void) {
+    while (all_top) {
+        TopHeaps *next = all_top->next;
+        free(all_top->files.items);
+        free(all_top->dirs.items);
+        free(all_top);
+        all_top = next;
+    }
+    thread_top = NULL;
+}
+
+/* One line of the --tree report. job is the kept walk of a directory, or
+   NULL for a file or a directory nothing was kept for. */
+typedef struct {
+    off_t size;
+    const char *name;
+    const char *color;
+    const SizeJob *job;
+    unsigned char is_dir;
+    unsigned char partial;
+} TreeItem;
+
+typedef struct {
+    TreeItem *items;
+    size_t count;
+    size_t next;
+    size_t prefix_len;
+} TreeFrame;
+
+/* Directories first, then by size, largest first, or by name with -n. */
+static int tree_item_cmp(const void *a, const void *b) {
+    const TreeItem *x = a, *y = b;
+    if (x->is_dir != y->is_dir)
+        return x->is_dir ? -1 : 1;
+    int c = 0;
+    if (!opt_sort_by_name && x->size != y->size)
+        c = x->size < y->size ? 1 : -1;
+    if (!c)
+        c = strcmp(x->name, y->name);
+    return opt_reverse_sort ? -c : c;
+}
+
+static int tree_item_shown(const char *name, off_t size, int show_hidden) {
+    return size >= opt_min_size && (show_hidden || name[0] != '.');
+}
+
+/* The shown children of a kept directory, sorted. */
+static size_t tree_children(const SizeJob *job, int show_hidden, TreeItem **out) {
+    size_t n = 0;
+    for (const SizeJob *c = job->children; c; c = c->sibling)
+        n++;
+    for (const TreeFile *f = job->files; f; f = f->next)
+        n++;
+    *out = NULL;
+    if (n == 0 || !(*out = malloc(n * sizeof(TreeItem))))
+        return 0;
+    n = 0;
+    for (const SizeJob *c = job->children; c; c = c->sibling) {
+        off_t size = atomic_load(&c->subtotal);
+        if (tree_item_shown(c->name, size, show_hidden))
+            (*out)[n++] = (TreeItem){ size, c->name, COLOR_DIR, c, 1,
+                                      atomic_load_explicit(&c->truncated, memory_order_relaxed) };
+    }
+    for (const TreeFile *f = job->files; f; f = f->next) {
+        if (tree_item_shown(f->name, f->size, show_hidden))
+            (*out)[n++] = (TreeItem){ f->size, f->name, COLOR_FILE, NULL, 0, 0 };
+    }
+    if (n == 0) {
+        free(*out);
+        *out = NULL;
+    }
+    qsort(*out, n, sizeof(TreeItem), tree_item_cmp);
+    return n;
+}
+
+static void tree_line(const TreeItem *it, const char *prefix, size_t prefix_len, size_t width) {
+    char size_str[28];
+    size_t pre = 0;
+    if (it->partial) {
+        memcpy(size_str, "\xe2\x89\xa5 ", 4);
+        pre = 4;
+    }
+    human_readable_size(it->size, size_str + pre, sizeof(size_str) - pre);
+    size_t len = strlen(size_str);
+    out_write("  ", 2);
+    out_pad(width - utf8_width(size_str, len));
+    out_str(size_color(it->size));
+    out_write(size_str, len);
+    out_str(COLOR_RESET "  ");
+    out_write(prefix, prefix_len);
+    out_str(it->color);
+    out_str(it->name);
+    out_str(COLOR_RESET "\n");
+}
+
+/* Walks the shown tree depth first with an explicit stack. With width 0
+   it only measures the size column and returns its width; otherwise it
+   prints each line with the size right-aligned to width. */
+static size_t tree_walk(TreeItem *top, size_t ntop, int show_hidden, size_t width) {
+    size_t depth = 0, frames_cap = 0, prefix_cap = 0, max = 0;
+    TreeFrame *frames = NULL;
+    char *prefix = NULL;
+    if (grow(&frames, &frames_cap, 1, sizeof(TreeFrame)) < 0)
+        return 0;
+    frames[depth++] = (TreeFrame){ top, ntop, 0, 0 };
+    while (depth > 0) {
+        TreeFrame *f = &frames[depth - 1];
+        if (f->next == f->count) {
+            if (f->items != top)
+                free(f->items);
+            depth--;
+            continue;
+        }
+        TreeItem *it = &f->items[f->next++];
+        int last = f->next == f->count;
+        size_t len = f->prefix_len;
+        if (grow(&prefix, &prefix_cap, len + 16, 1) < 0)
+            break;
+        /* the connector for this line, then what its children continue with */
+        memcpy(prefix + len, last ? "\xe2\x94\x94\xe2\x94\x80\xe2\x94\x80 " : "\xe2\x94\x9c\xe2\x94\x80\xe2\x94\x80 ", 10);
+        char size_str[28];
+        human_readable_size(it->size, size_str, sizeof(size_str));
+        size_t w = strlen(size_str) + (it->partial ? 2 : 0);
+        if (w > max)
+            max = w;
+        if (width)
+            tree_line(it, prefix, len + 10, width);
+        TreeItem *kids;
+        size_t n = it->job ? tree_children(it->job, show_hidden, &kids) : 0;
+        if (n == 0)
+            continue;
+        if (grow(&frames, &frames_cap, depth + 1, sizeof(TreeFrame)) < 0) {
+            free(kids);
+            break;
+        }
+        if (last) {
+            memcpy(prefix + len, "    ", 4);
+            len += 4;
+        } else {
+            memcpy(prefix + len, "\xe2\x94\x82   ", 6);
+            len += 6;
+        }
+        frames[depth++] = (TreeFrame){ kids, n, 0, len };
+    }
+    while (depth > 1)
+        free(frames[--depth].items);
+    free(frames);
+    free(prefix);
+    return max;
+}
+
+static int tree_job_name_cmp(const void *a, const void *b) {
+    return strcmp((*(SizeJob *const *)a)->name, (*(SizeJob *const *)b)->name);
+}
+
+static int tree_job_find_cmp(const void *name, const void *job) {
+    return strcmp(name, (*(SizeJob *const *)job)->name);
+}
+
+/* Prints the --tree report of a listing: its shown entries, and under each
+   directory what its size walk kept, with every total computed bottom-up
+   by that single walk. */
+void tree_report(DirListing *l) {
+    if (opt_format != FORMAT_TEXT || stream_json)
+        return;
+    size_t nroots = 0;
+    for (SizeJob *j = atomic_load(&l->tree); j; j = j->sibling)
+        nroots++;
+    SizeJob **roots = malloc((nroots ? nroots : 1) * sizeof(SizeJob *));
+    TreeItem *top = malloc((l->count ? l->count : 1) * sizeof(TreeItem));
+    if (!roots || !top) {
+        free(roots);
+        free(top);
+        return;
+    }
+    nroots = 0;
+    for (SizeJob *j = atomic_load(&l->tree); j; j = j->sibling)
+        roots[nroots++] = j;
+    qsort(roots, nroots, sizeof(SizeJob *), tree_job_name_cmp);
+    TreeItem root = { 0, l->dirpath, COLOR_DIR, NULL, 1, 0 };
+    size_t ntop = 0;
+    for (size_t i = 0; i < l->count; i++) {
+        FileEntry *fe = l->entries[i];
+        if (is_dot_or_dotdot(fe->name))
+            continue;
+        root.size += fe->size;
+        root.partial |= fe->size_partial;
+        if (!tree_item_shown(fe->name, fe->size, l->show_hidden))
+            continue;
+        SizeJob **job = fe->is_dir ? bsearch(fe->name, roots, nroots, sizeof(SizeJob *), tree_job_find_cmp) : NULL;
+        top[ntop++] = (TreeItem){ fe->size, fe->name, name_color(fe), job ? *job : NULL, fe->is_dir,
+                                fe->size_partial };
+    }
+    qsort(top, ntop, sizeof(TreeItem), tree_item_cmp);
+    size_t width = tree_walk(top, ntop, l->show_hidden, 0);
+    char size_str[28];
+    human_readable_size(root.size, size_str, sizeof(size_str));
+    if (strlen(size_str) + (root.partial ? 2 : 0) > width)
+        width = strlen(size_str) + (root.partial ? 2 : 0);
+    out_write("\n", 1);
+    out_str("tree of ");
+    out_str(l->dirpath);
+    out_write(":\n", 2);
+    tree_line(&root, "", 0, width);
+    tree_walk(top, ntop, l->show_hidden, width);
+    free(roots);
+    free(top);
+}
+
+/* Formats every field once into a column store, then writes the padded
+   lines into the output buffer. Nothing here makes a syscall except the
+   buffer flushes; symlink targets are resolved by populate_file_entry. */
+void print_entries(FileEntry **entries, size_t count, int show_inode) {
+    if (stream_json)
+        return;
+    if (opt_format != FORMAT_TEXT) {
+        print_records(entries, count);
+        return;
+    }
+    size_t max_user = 0, max_size = 0, max_date = 0, max_inode = 0, max_nlink = 0;
+    EntryColumns *cols = malloc((count ? count : 1) * sizeof(EntryColumns));
+    if (!cols)
+        return;
+    OwnerTable owners = {0};
+    time_t now = time(NULL);
+    char num[24];
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *fe = entries[i];
+        EntryColumns *c = &cols[i];
+        c->owner = owner_lookup(&owners, fe->uid, fe->gid);
+        size_t pre = 0;
+        if (fe->size_partial) {
+            memcpy(c->size_str, "\xe2\x89\xa5 ", 4);
+            pre = 4;
+        }
+        human_readable_size(fe->size, c->size_str + pre, sizeof(c->size_str) - pre);
+        time_ago(fe->mtime, now, c->time_str, sizeof(c->time_str));
+        if (fe->size_pending)
+            strcat(c->size_str, "\xe2\x80\xa6");
+        c->size_len = strlen(c->size_str);
+        c->size_width = utf8_width(c->size_str, c->size_len);
+        c->time_len = strlen(c->time_str);
+        if (c->owner->len > max_user)
+            max_user = c->owner->len;
+        if (c->size_width > max_size)
+            max_size = c->size_width;
+        if (c->time_len > max_date)
+            max_date = c->time_len;
+        if (show_inode) {
+            size_t len = format_u64(fe->inode, num);
+            if (len > max_inode)
+                max_inode = len;
+            len = format_u64(fe->nlink, num);
+            if (len > max_nlink)
+                max_nlink = len;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *fe = entries[i];
+        EntryColumns *c = &cols[i];
+        if (show_inode) {
+            out_field(num, format_u64(fe->inode, num), max_inode);
+            out_write("  ", 2);
+            out_field(num, format_u64(fe->nlink, num), max_nlink);
+            out_write("  ", 2);
+        }
+        char perms[11];
+        get_permission_string(fe->mode, perms);
+        out_write(perms, 10);
+        out_write("  ", 2);
+        out_field(c->owner->str, c->owner->len, max_user);
+        out_write("  ", 2);
+        out_str(size_color(fe->size));
+        out_field_cols(c->size_str, c->size_len, c->size_width, max_size);
+        out_str(COLOR_RESET "  ");
+        out_str(date_color(fe->mtime, now));
+        out_field(c->time_str, c->time_len, max_date);
+        out_str(COLOR_RESET "  ");
+        out_str(name_color(fe));
+        out_str(fe->name);
+        out_str(COLOR_RESET);
+        if (fe->is_symlink && fe->link_target) {
+            mode_t target_mode = (mode_t)fe->target_type << 12;
+            out_str(" -> ");
+            out_str(fe->target_type && S_ISDIR(target_mode) ? COLOR_DIR : COLOR_LINKTARGET);
+            out_str(fe->link_target);
+            out_str(COLOR_RESET);
+            if (fe->target_type && S_ISCHR(target_mode))
+                out_str(COLOR_RED "*" COLOR_RESET);
+            else if (fe->target_type && S_ISBLK(target_mode))
+                out_str(COLOR_YELLOW "#" COLOR_RESET);
+        }
+        if (S_ISCHR(fe->mode))
+            out_str(COLOR_RED "*" COLOR_RESET);
+        else if (S_ISBLK(fe->mode))
+            out_str(COLOR_YELLOW "#" COLOR_RESET);
+        out_write("\n", 1);
+    }
+    free(owners.slots);
+    free(cols);
+}
+
+/* Redraws the in-progress listing in place on a terminal: entries stat'ed
+   so far in sort order, as many as fit, and a status line. Directories still
+   being walked show their partial size with a trailing ellipsis. */
+static size_t live_redraw(FileEntry **entries, size_t count, size_t drawn, int show_inode) {
+    struct winsize ws;
+    size_t rows = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2)
+        rows = ws.ws_row;
+    FileEntry *snap = malloc((count ? count : 1) * sizeof(FileEntry));
+    FileEntry **ptrs = malloc((count ? count : 1) * sizeof(FileEntry *));
+    if (!snap || !ptrs) {
+        free(snap);
+        free(ptrs);
+        return drawn;
+    }
+    size_t ready = 0, pending = 0;
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *fe = __atomic_load_n(&entries[i], __ATOMIC_ACQUIRE);
+        if (!fe)
+            continue;
+        /* size and size_pending are still being written by walkers; every
+           other field is fixed once the entry is published */
+        FileEntry *s = &snap[ready];
+        s->name = fe->name;
+        s->dir = fe->dir;
+        s->link_target = fe->link_target;
+        s->mtime = fe->mtime;
+        s->inode = fe->inode;
+        s->nlink = fe->nlink;
+        s->mode = fe->mode;
+        s->uid = fe->uid;
+        s->gid = fe->gid;
+        s->is_dir = fe->is_dir;
+        s->target_type = fe->target_type;
+        s->is_symlink = fe->is_symlink;
+        snap[ready].size_pending = __atomic_load_n(&fe->size_pending, __ATOMIC_ACQUIRE);
+        snap[ready].size = __atomic_load_n(&fe->size, __ATOMIC_RELAXED);
+        snap[ready].size_partial = snap[ready].size_pending ? 0 : fe->size_partial;
+        pending += snap[ready].size_pending;
+        ptrs[ready] = &snap[ready];
+        ready++;
+    }
+    sort_entries(ptrs, ready);
+    size_t shown = ready < rows - 2 ? ready : rows - 2;
+    char num[24];
+    if (drawn) {
+        out_write("\033[", 2);
+        out_write(num, format_u64(drawn, num));
+        out_write("A", 1);
+    }
+    out_str("\r\033[J\033[?7l");
+    print_entries(ptrs, shown, show_inode);
+    out_str(COLOR_DARK_GREY "scanning: ");
+    out_write(num, format_u64(ready, num));
+    out_str(" entries, ");
+    out_write(num, format_u64(pending, num));
+    out_str(" directories pending" COLOR_RESET "\n\033[?7h");
+    out_flush();
+    free(snap);
+    free(ptrs);
+    return shown + 1;
+}
+
+static void live_clear(size_t drawn) {
+    char num[24];
+    if (!drawn)
+        return;
+    out_write("\033[", 2);
+    out_write(num, format_u64(drawn, num));
+    out_str("A\r\033[J");
+}
+
+void listing_init(DirListing *l, const char *dirpath, int show_hidden, int print_header) {
+    memset(l, 0, sizeof(*l));
+    l->dirpath = strdup(dirpath);
+    l->dirfd = -1;
+    l->show_hidden = show_hidden;
+    l->print_header = print_header;
+    l->failed = l->dirpath == NULL;
+    l->pool = worker_pool;
+    arena_init(&l->arena);
+    task_group_init(&l->group);
+    l->scope.group = &l->group;
+    if (opt_tree)
+        l->scope.tree = &l->tree;
+}
+
+/* Reads the directory and queues its entries and size walks on the pool.
+   Always drops the group's setup reference, also when the directory cannot
+   be read, so whoever waits on the listing or its claim is released. */
+void listing_start(DirListing *l) {
+    if (opt_deadline_ms)
+        l->scope.deadline = monotonic_ns() + (uint64_t)opt_deadline_ms * 1000000;
+    uint64_t start = stats_clock();
+    if (!l->failed)
+        l->dirfd = open(l->dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_calls(SC_OPEN, 1);
+    DirReader reader;
+    if (l->dirfd < 0 || dir_reader_init(&reader, l->dirfd) < 0) {
+        l->failed = 1;
+        task_group_release(&l->group);
+        return;
+    }
+    struct stat dirst;
+    if (opt_one_fs && fstat(l->dirfd, &dirst) == 0)
+        l->scope.fs_dev = dirst.st_dev;
+    /* hidden entries of a claimed directory still count towards its total */
+    int keep_hidden = l->show_hidden || l->scope.claim;
+    struct linux_dirent64 *de;
+    while ((de = dir_reader_next(&reader)) != NULL) {
+        if (!keep_hidden && de->d_name[0] == '.')
+            continue;
+        if (!l->show_hidden && is_dot_or_dotdot(de->d_name))
+            continue;
+        if (name_excluded(de->d_name))
+            continue;
+        name_list_add(&l->names, de->d_name);
+    }
+    int read_error = reader.error;
+    dir_reader_release(&reader);
+    stats_phase(PH_READDIR, start);
+    stats_visit(1, l->names.count);
+    size_t n = l->names.count;
+    FileEntry *store = arena_alloc(&l->arena, (n ? n : 1) * sizeof(FileEntry));
+    l->entries = arena_alloc(&l->arena, (n ? n : 1) * sizeof(FileEntry *));
+    ThreadTaskArg *args = NULL;
+    if (store && l->entries && l->pool && n >= THREAD_THRESHOLD)
+        args = arena_alloc(&l->arena, n * sizeof(ThreadTaskArg));
+    if ((read_error && n == 0) || !store || !l->entries) {
+        l->failed = 1;
+        task_group_release(&l->group);
+        return;
+    }
+    memset(l->entries, 0, (n ? n : 1) * sizeof(FileEntry *));
+    size_t count = 0;
+    const char *name = l->names.data;
+    for (size_t i = 0; i < n; i++, name += strlen(name) + 1) {
+        if (args) {
+            args[count].dir = l;
+            args[count].dname = name;
+            args[count].entry = &store[count];
+            args[count].result = &l->entries[count];
+            task_group_add(&l->group);
+            thread_pool_add_task(l->pool, process_entry_task, &args[count]);
+            count++;
+        } else {
+            struct stat st;
+            start = stats_clock();
+            stats_calls(SC_STAT, 1);
+            if (stat_at(l->dirfd, name, AT_SYMLINK_NOFOLLOW, entry_stat_mask(), &st) < 0)
+                continue;
+            populate_file_entry(&store[count], l, name, &st);
+            l->entries[count] = &store[count];
+            count++;
+            stats_phase(PH_STAT, start);
+        }
+    }
+    l->count = count;
+    task_group_release(&l->group);
+}
+
+void listing_free(DirListing *l) {
+    if (l->dirfd >= 0)
+        close(l->dirfd);
+    l->dirfd = -1;
+    tree_free(atomic_exchange(&l->tree, NULL));
+    arena_free(&l->arena);
+    free(l->names.data);
+    l->names.data = NULL;
+    free(l->dirpath);
+    l->dirpath = NULL;
+}
+
+/* Waits for the listing's own work, then sorts and prints it. A repeated
+   directory prints the entries of its first listing under its own name. */
+void listing_finish(DirListing *l, int show_inode) {
+    DirListing *src = l->same ? l->same : l;
+    if (src->failed) {
+        task_group_wait(&src->group);
+        return;
+    }
+    if (l->print_header && !stream_json && opt_format == FORMAT_TEXT) {
+        out_str(l->dirpath);
+        out_write(":\n", 2);
+    }
+    uint64_t start;
+    if (!l->same) {
+        start = stats_clock();
+        if (l->pool && opt_stream) {
+            size_t drawn = 0;
+            while (!thread_pool_wait_timeout(l->pool, stream_json ? 100 : 200)) {
+                if (stream_json) {
+                    pthread_mutex_lock(&out_lock);
+                    out_flush();
+                    pthread_mutex_unlock(&out_lock);
+                } else
+                    drawn = live_redraw(l->entries, l->count, drawn, show_inode);
+            }
+            live_clear(drawn);
+        }
+        task_group_wait(&l->group);
+        stats_phase(PH_WAIT, start);
+        close(l->dirfd);
+        l->dirfd = -1;
+        if (stream_json) {
+            stream_emit_end(l->dirpath);
+            return;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < l->count; i++) {
+            FileEntry *fe = l->entries[i];
+            if (fe && (l->show_hidden || fe->name[0] != '.'))
+                l->entries[kept++] = fe;
+        }
+        l->count = kept;
+        start = stats_clock();
+        sort_entries(l->entries, l->count);
+        stats_phase(PH_SORT, start);
+    }
+    start = stats_clock();
+    print_entries(src->entries, src->count, show_inode);
+    if (opt_top)
+        top_report(l->dirpath);
+    if (opt_tree)
+        tree_report(src);
+    stats_phase(PH_PRINT, start);
+    if (l->print_header && opt_format == FORMAT_TEXT)
+        out_write("\n", 1);
+}
+
+void process_directory(const char *dirpath, int show_hidden, int print_header, int show_inode) {
+    DirListing l;
+    listing_init(&l, dirpath, show_hidden, print_header);
+    listing_start(&l);
+    listing_finish(&l, show_inode);
+    listing_free(&l);
+    task_group_destroy(&l.group);
+}
+
+static int listing_id_cmp(const void *a, const void *b) {
+    const DirListing *x = *(DirListing *const *)a, *y = *(DirListing *const *)b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Before anything starts: points repeated directories at their first
+   listing, and turns directories that lie inside another argument into
+   claims, so no subtree is walked twice. */
+static void listings_plan(DirListing *ls, size_t n) {
+    DirListing **by_id = malloc(n * sizeof(DirListing *));
+    char **real = calloc(n, sizeof(char *));
+    char **sorted = malloc(n * sizeof(char *));
+    if (!by_id || !real || !sorted) {
+        free(by_id);
+        free(real);
+        free(sorted);
+        return;
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct stat st;
+        if (!ls[i].failed && stat(ls[i].dirpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+            ls[i].dev = st.st_dev;
+            ls[i].ino = st.st_ino;
+            by_id[m++] = &ls[i];
+        }
+    }
+    qsort(by_id, m, sizeof(DirListing *), listing_id_cmp);
+    for (size_t i = 1; i < m; i++) {
+        DirListing *first = by_id[i - 1]->same ? by_id[i - 1]->same : by_id[i - 1];
+        if (by_id[i]->dev == first->dev && by_id[i]->ino == first->ino) {
+            by_id[i]->same = first;
+            first->keep = 1;
+        }
+    }
+    size_t nreal = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ls[i].same || ls[i].failed || !ls[i].ino)
+            continue;
+        real[i] = realpath(ls[i].dirpath, NULL);
+        if (real[i]) {
+            ls[i].scope.rank = strlen(real[i]);
+            sorted[nreal++] = real[i];
+        }
+    }
+    qsort(sorted, nreal, sizeof(char *), path_cmp);
+    claims = malloc((nreal ? nreal : 1) * sizeof(Claim *));
+    for (size_t i = 0; i < n && claims; i++) {
+        if (!real[i] || !strcmp(real[i], "/"))
+            continue;
+        int nested = 0;
+        char *up = strdup(real[i]);
+        char *slash;
+        while (up && !nested && (slash = strrchr(up, '/')) != NULL) {
+            if (slash == up)
+                slash[1] = '\0';
+            else
+                slash[0] = '\0';
+            char *key = up;
+            nested = bsearch(&key, sorted, nreal, sizeof(char *), path_cmp) != NULL;
+            if (slash == up)
+                break;
+        }
+        free(up);
+        Claim *c = nested ? calloc(1, sizeof(Claim)) : NULL;
+        if (!c)
+            continue;
+        c->dev = ls[i].dev;
+        c->ino = ls[i].ino;
+        c->rank = ls[i].scope.rank;
+        pthread_mutex_init(&c->lock, NULL);
+        ls[i].scope.claim = c;
+        ls[i].group.on_done = claim_complete;
+        ls[i].group.ctx = c;
+        claims[claim_count++] = c;
+    }
+    qsort(claims, claim_count, sizeof(Claim *), claim_cmp);
+    for (size_t i = 0; i < n; i++)
+        free(real[i]);
+    free(real);
+    free(sorted);
+    free(by_id);
+}
+
+#define LISTINGS_AHEAD 32
+
+/* LISTINGS_AHEAD, or fewer under a low RLIMIT_NOFILE since each listing
+   in flight holds its directory open. */
+static size_t listings_ahead = LISTINGS_AHEAD;
+
+/* Lists every directory argument. On the pool, up to LISTINGS_AHEAD
+   listings run ahead of the one being printed, and claimed ones are all
+   started first since outer walks wait on them. --stream, --top and
+   --tree show one listing at a time and keep them strictly one after
+   another. */
+void run_listings(DirListing *ls, size_t n, int show_inode) {
+    int ahead = worker_pool && !opt_stream && !opt_top && !opt_tree && n > 1;
+    if (ahead)
+        listings_plan(ls, n);
+    for (size_t i = 0; ahead && i < n; i++) {
+        if (ls[i].scope.claim)
+            listing_start(&ls[i]);
+    }
+    size_t next = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!ahead)
+            next = i;
+        for (; next < n && next <= i + (ahead ? listings_ahead : 0); next++) {
+            if (!ls[next].same && !ls[next].scope.claim)
+                listing_start(&ls[next]);
+        }
+        listing_finish(&ls[i], show_inode);
+        /* on a terminal each listing shows up as soon as it is done */
+        if (out_is_tty) {
+            pthread_mutex_lock(&out_lock);
+            out_flush();
+            pthread_mutex_unlock(&out_lock);
+        }
+        if (!ls[i].keep)
+            listing_free(&ls[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        listing_free(&ls[i]);
+        task_group_destroy(&ls[i].group);
+    }
+    for (size_t i = 0; i < claim_count; i++) {
+        pthread_mutex_destroy(&claims[i]->lock);
+        free(claims[i]);
+    }
+    free(claims);
+    claims = NULL;
+    claim_count = 0;
+}
+
+void process_path(const char *path, int show_hidden, int print_header,
+                  DirListing *args, FileEntry ***file_files, size_t *file_count, size_t *file_cap, int show_inode) {
+    struct stat st;
+    if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return;
+    if (S_ISDIR(st.st_mode))
+        process_directory(path, show_hidden, print_header, show_inode);
+    else
+        process_file_collect(path, args, file_files, file_count, file_cap);
+}
+
+/* "10M", "1.5G" and the like, in powers of 1024; a bare number is bytes. */
+static int parse_size(const char *s, off_t *out) {
+    char *end;
+    double v = strtod(s, &end);
+    const char *units = "BKMGT";
+    const char *u = *end ? strchr(units, *end) : units;
+    if (end == s || v < 0 || !u || (*end && end[1] && strcmp(end + 1, "B")))
+        return -1;
+    for (; u > units; u--)
+        v *= 1024;
+    *out = (off_t)v;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int show_hidden = 0, show_inode = 0, nonflag_count = 0, num_threads = 0;
+    const char *daemon_socket = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == '-') {
+            if (!strcmp(argv[i], "--cache"))
+                opt_cache = 1;
+            else if (!strcmp(argv[i], "--cache-verify"))
+                opt_cache = opt_cache_verify = 1;
+            else if (!strcmp(argv[i], "--count-links-once"))
+                opt_count_links_once = 1;
+            else if (!strcmp(argv[i], "--allocated"))
+                opt_allocated = 1;
+            else if (!strcmp(argv[i], "--stats"))
+                opt_stats = 1;
+            else if (!strcmp(argv[i], "--format=text"))
+                opt_format = FORMAT_TEXT;
+            else if (!strcmp(argv[i], "--format=ndjson"))
+                opt_format = FORMAT_NDJSON;
+            else if (!strcmp(argv[i], "--format=csv"))
+                opt_format = FORMAT_CSV;
+            else if (!strcmp(argv[i], "--format=binary"))
+                opt_format = FORMAT_BINARY;
+            else if (!strncmp(argv[i], "--daemon=", 9) && argv[i][9])
+                daemon_socket = argv[i] + 9;
+            else if (!strncmp(argv[i], "--query=", 8) && argv[i][8])
+                opt_query = argv[i] + 8;
+            else if (!strncmp(argv[i], "--top=", 6) && atoi(argv[i] + 6) > 0)
+                opt_top = atoi(argv[i] + 6);
+            else if (!strcmp(argv[i], "--tree"))
+                opt_tree = 1;
+            else if (!strncmp(argv[i], "--max-depth=", 12) && atoi(argv[i] + 12) > 0)
+                opt_tree = 1, opt_tree_depth = atoi(argv[i] + 12);
+            else if (!strncmp(argv[i], "--min-size=", 11) && parse_size(argv[i] + 11, &opt_min_size) == 0)
+                opt_tree = 1;
+            else if (!strncmp(argv[i], "--exclude=", 10) && argv[i][10]) {
+                if (pattern_add(&excludes, argv[i] + 10) < 0)
+                    return EXIT_FAILURE;
+            } else if (!strncmp(argv[i], "--include=", 10) && argv[i][10]) {
+                if (pattern_add(&includes, argv[i] + 10) < 0)
+                    return EXIT_FAILURE;
+            } else if (!strcmp(argv[i], "--stream"))
+                opt_stream = 1;
+            else if (!strcmp(argv[i], "--uring"))
+                opt_uring = 1;
+            else if (!strncmp(argv[i], "--deadline=", 11) && atol(argv[i] + 11) > 0)
+                opt_deadline_ms = atol(argv[i] + 11);
+            else if (!strcmp(argv[i], "--dont-sync"))
+                opt_statx_sync = AT_STATX_DONT_SYNC;
+            else if (!strcmp(argv[i], "--one-file-system"))
+                opt_one_fs = 1;
+            else if (!strncmp(argv[i], "--device-jobs=", 14) && atoi(argv[i] + 14) > 0)
+                opt_device_jobs = atoi(argv[i] + 14);
+            else if (!strncmp(argv[i], "--threads=", 10) && atoi(argv[i] + 10) > 0)
+                num_threads = atoi(argv[i] + 10);
+            else if (!strcmp(argv[i], "--cache-clear")) {
+                if (dir_cache_clear() < 0) {
+                    fprintf(stderr, "lsp: cannot clear cache: %s\n", strerror(errno));
+                    return EXIT_FAILURE;
+                }
+            } else {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (argv[i][0] == '-' && strlen(argv[i]) > 1) {
+            size_t len = strlen(argv[i]);
             for (size_t j = 1; j < len; j++) {
                 if (argv[i][j] == 'h')
                     show_hidden = 1;
@@ -703,6 +5181,10 @@ int main(int argc, char *argv[]) {
                     opt_sort_by_name = 1;
                 else if (argv[i][j] == 'r')
                     opt_reverse_sort = 1;
+                else if (argv[i][j] == 'x')
+                    opt_one_fs = 1;
+                else if (argv[i][j] == 'R')
+                    opt_tree = 1;
                 else {
                     fprintf(stderr, "Unknown flag: -%c\n", argv[i][j]);
                     return EXIT_FAILURE;
@@ -712,6 +5194,62 @@ int main(int argc, char *argv[]) {
             nonflag_count++;
         }
     }
+    if (daemon_socket) {
+        if (opt_count_links_once || nonflag_count > 1) {
+            fprintf(stderr, "lsp: --daemon takes one directory and cannot count links once\n");
+            return EXIT_FAILURE;
+        }
+        const char *dir = ".";
+        for (int i = 1; i < argc; i++)
+            if (argv[i][0] != '-' || strlen(argv[i]) == 1)
+                dir = argv[i];
+        return watch_daemon(daemon_socket, dir);
+    }
+    if (opt_query && excludes.count) {
+        fprintf(stderr, "lsp: --query cannot be combined with --exclude, computing sizes directly\n");
+        opt_query = NULL;
+    }
+    if (opt_cache && excludes.count) {
+        fprintf(stderr, "lsp: --cache cannot be combined with --exclude, continuing without cache\n");
+        opt_cache = opt_cache_verify = 0;
+    }
+    if (opt_cache && opt_count_links_once) {
+        fprintf(stderr, "lsp: --cache cannot be combined with --count-links-once, continuing without cache\n");
+        opt_cache = opt_cache_verify = 0;
+    }
+    if (opt_cache && dir_cache_open() < 0) {
+        fprintf(stderr, "lsp: cache directory unavailable, continuing without cache\n");
+        opt_cache = opt_cache_verify = 0;
+    }
+    if (!num_threads)
+        num_threads = thread_pool_default_size();
+    struct rlimit nofile;
+    long fds = 16384;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY && nofile.rlim_cur < (rlim_t)fds)
+        fds = nofile.rlim_cur;
+    if ((long)listings_ahead > fds / 8)
+        listings_ahead = fds / 8;
+    /* stdio and cache fds, every listing in flight, and per worker its
+       io_uring ring, the directory it reads, a reopen in progress and its
+       --query connection */
+    long reserved = 16 + (long)listings_ahead + 1 + (opt_query ? 5L : 4L) * num_threads;
+    walk_fd_budget = fds > reserved ? (fds - reserved) / 2 : 0;
+    if (walk_fd_budget > 4096)
+        walk_fd_budget = 4096;
+    uint64_t run_start = stats_clock();
+    worker_pool = thread_pool_create(num_threads);
+    if (opt_stream && (opt_format == FORMAT_CSV || opt_format == FORMAT_BINARY)) {
+        fprintf(stderr, "lsp: --stream only supports text and ndjson output, continuing without it\n");
+        opt_stream = 0;
+    }
+    out_is_tty = isatty(STDOUT_FILENO);
+    stream_json = opt_stream && (opt_format == FORMAT_NDJSON || !out_is_tty);
+    DirListing file_args;
+    listing_init(&file_args, "", 0, 0);
+    file_args.dirfd = AT_FDCWD;
+    free(file_args.dirpath);
+    file_args.dirpath = NULL;
+    file_args.pool = NULL;
     FileEntry **file_files = NULL;
     size_t file_count = 0, file_cap = 16;
     file_files = malloc(file_cap * sizeof(FileEntry *));
@@ -721,39 +5259,76 @@ int main(int argc, char *argv[]) {
         process_directory(".", show_hidden, 0, show_inode);
     } else {
         int print_header = (nonflag_count > 1);
+        char **dirs = NULL;
+        size_t dir_count = 0, dir_cap = 0;
         for (int i = 1; i < argc; i++) {
             if (argv[i][0] == '-' && strlen(argv[i]) > 1)
                 continue;
             glob_t results;
             int ret = glob(argv[i], 0, NULL, &results);
+            size_t matches = ret != 0 ? 1 : results.gl_pathc;
+            if (dir_count + matches > dir_cap) {
+                dir_cap = (dir_count + matches) * 2;
+                char **tmp = realloc(dirs, dir_cap * sizeof(char *));
+                if (!tmp)
+                    return EXIT_FAILURE;
+                dirs = tmp;
+            }
             if (ret != 0) {
-                process_directory(argv[i], show_hidden, print_header, show_inode);
-                process_file_collect(argv[i], &file_files, &file_count, &file_cap);
+                dirs[dir_count++] = strdup(argv[i]);
+                process_file_collect(argv[i], &file_args, &file_files, &file_count, &file_cap);
             } else {
                 for (size_t j = 0; j < results.gl_pathc; j++) {
                     struct stat st;
                     if (fstatat(AT_FDCWD, results.gl_pathv[j], &st, AT_SYMLINK_NOFOLLOW) == 0 &&
                         S_ISDIR(st.st_mode))
-                        process_directory(results.gl_pathv[j], show_hidden, print_header, show_inode);
+                        dirs[dir_count++] = strdup(results.gl_pathv[j]);
                     else
-                        process_file_collect(results.gl_pathv[j], &file_files, &file_count, &file_cap);
+                        process_file_collect(results.gl_pathv[j], &file_args, &file_files, &file_count, &file_cap);
                 }
             }
             globfree(&results);
         }
+        DirListing *listings = calloc(dir_count ? dir_count : 1, sizeof(DirListing));
+        if (!listings)
+            return EXIT_FAILURE;
+        for (size_t i = 0; i < dir_count; i++) {
+            listing_init(&listings[i], dirs[i] ? dirs[i] : "", show_hidden, print_header);
+            free(dirs[i]);
+        }
+        free(dirs);
+        run_listings(listings, dir_count, show_inode);
+        free(listings);
         if (file_count > 0) {
-            qsort(file_files, file_count, sizeof(FileEntry *), cmp_entries);
+            uint64_t start = stats_clock();
+            sort_entries(file_files, file_count);
+            stats_phase(PH_SORT, start);
+            start = stats_clock();
             print_entries(file_files, file_count, show_inode);
-            for (size_t i = 0; i < file_count; i++) {
-                free(file_files[i]->name);
-                if (file_files[i]->link_target)
-                    free(file_files[i]->link_target);
-                free(file_files[i]);
-            }
-            free(file_files);
+            stats_phase(PH_PRINT, start);
         }
     }
-    free_uid_cache();
-    free_gid_cache();
-    return EXIT_SUCCESS;
+    free(file_files);
+    listing_free(&file_args);
+    task_group_destroy(&file_args.group);
+    out_flush();
+    if (worker_pool)
+        thread_pool_destroy(worker_pool);
+    if (opt_top)
+        top_free();
+    if (opt_stats) {
+        stats_report(monotonic_ns() - run_start);
+        stats_free();
+    }
+    if (opt_cache) {
+        if (dir_cache_save() < 0)
+            fprintf(stderr, "lsp: cannot write cache %s\n", dir_cache.path);
+        dir_cache_close();
+    }
+    if (opt_count_links_once)
+        inode_set_free();
+    id_names_free();
+    free(excludes.items);
+    free(includes.items);
+    return atomic_load(&walk_errors) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
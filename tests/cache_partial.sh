@@ -0,0 +1,22 @@
+#!/bin/sh
+# A total that hit a read error must not be cached as exact: the second
+# --cache run has to show the same lower bound and exit status.
+# usage: cache_partial.sh [LSP_BINARY]
+lsp=${1:-./lsp}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/tree/d/sub"
+head -c 5000 /dev/zero > "$tmp/tree/d/sub/f"
+ln -s loop "$tmp/tree/d/sub/loop"
+
+for run in 1 2; do
+    XDG_CACHE_HOME=$tmp/cache "$lsp" --cache "$tmp/tree" > "$tmp/out" 2> "$tmp/err"
+    rc=$?
+    if [ $rc -ne 1 ] || ! grep -q '≥' "$tmp/out" || ! grep -q 'cannot stat' "$tmp/err"; then
+        echo "$0: run $run: expected a partial total and exit status 1, got $rc:" >&2
+        cat "$tmp/out" "$tmp/err" >&2
+        exit 1
+    fi
+done
+echo "cache_partial: ok"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# bench/strace_calls.awk on `strace -c` summaries as written by strace 4
+# (empty usecs/call in the total row) and by strace 5 and later.
+here=$(dirname "$0")
+tmp=$(mktemp)
+trap 'rm -f "$tmp"' EXIT
+status=0
+
+check() {
+    got=$(awk -f "$here/../bench/strace_calls.awk" "$tmp")
+    if [ "$got" != "$2" ]; then
+        echo "$0: $1: expected $2 calls, got '$got'" >&2
+        status=1
+    fi
+}
+
+cat > "$tmp" <<'OUT'
+% time     seconds  usecs/call     calls    errors syscall
+------ ----------- ----------- --------- --------- ----------------
+ 60.00    0.000018           2         9           mmap
+ 40.00    0.000012           1        12         2 openat
+  0.00    0.000000           0         7           close
+------ ----------- ----------- --------- --------- ----------------
+100.00    0.000030                    28         2 total
+OUT
+check "strace 4" 28
+
+cat > "$tmp" <<'OUT'
+% time     seconds  usecs/call     calls    errors syscall
+------ ----------- ----------- --------- --------- ------------------
+ 45.12    0.000231           7        31           mmap
+ 30.08    0.000154          15        10         2 openat
+ 24.80    0.000127           7        17           getdents64
+------ ----------- ----------- --------- --------- ------------------
+100.00    0.000512           8        58         2 total
+OUT
+check "strace 6" 58
+
+: > "$tmp"
+check "no summary" ""
+
+[ $status = 0 ] && echo "strace_calls: ok"
+exit $status